@@ -0,0 +1,218 @@
+/*
+ * Copyright (C) 2015 - 2016  Fabian Klötzl
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Time the phases of afra on a set of matrices for several numbers of threads,
+ * and check that all quartet kernels yield the same support values. The
+ * results are printed as tab-separated values with a header line. Kernels
+ * the CPU does not support take nan seconds, disagreeing ones -1. */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <err.h>
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "global.h"
+#include "graph.h"
+#include "io.h"
+#include "matrix.h"
+#include "quartet.h"
+
+static afra_ctx *ctx;
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void report(const char *file, size_t size, const char *phase,
+                   const char *detail, double seconds) {
+	printf("%s\t%zu\t%d\t%s\t%s\t%.6f\n", file, size, ctx->threads, phase,
+	       detail, seconds);
+	fflush(stdout);
+}
+
+static void check(int status) {
+	if (status != 0) errx(1, "%s", afra_message(ctx));
+}
+
+static matrix load(const char *file) {
+	FILE *in = fopen(file, "r");
+	if (!in) err(1, "%s", file);
+	matrix distance;
+	if (read_matrix(ctx, in, 0, &distance) != 0) {
+		errx(1, "%s: %s", file, afra_message(ctx));
+	}
+	fclose(in);
+	return distance;
+}
+
+/** @brief Collect the support values of all branches, in the order of the
+ * node pool. */
+static void collect(const tree_s *tree, double *supports) {
+	size_t k = 0;
+	for (size_t i = tree->size; i < 2 * tree->size - 3; i++) {
+		supports[k++] = tree->pool[i].left_support;
+		supports[k++] = tree->pool[i].right_support;
+	}
+	supports[k++] = tree->root.left_support;
+	supports[k++] = tree->root.right_support;
+	supports[k++] = tree->root.extra_support;
+}
+
+/** @brief Compare the supports computed with every available kernel to the
+ * ones of the scalar kernel, with the current number of threads.
+ *
+ * @returns the number of kernels that disagree.
+ */
+static int check_kernels(const char *file, matrix *distance, tree_s *tree) {
+	static const char *kernels[] = {"scalar", "avx2", "avx512", "mixed", "sorted"};
+	size_t count = 2 * tree->size;
+	double *expected = calloc(count, sizeof(double));
+	double *actual = calloc(count, sizeof(double));
+	CHECK_MALLOC(expected);
+	CHECK_MALLOC(actual);
+
+	int failures = 0;
+	for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+		if (quartet_kernel(ctx, kernels[k]) != 0) {
+			report(file, distance->size, "kernel", kernels[k], NAN);
+			continue;
+		}
+
+		double start = now();
+		check(quartet_all(ctx, distance, tree));
+		double seconds = now() - start;
+
+		collect(tree, k ? actual : expected);
+		int same = !k || memcmp(expected, actual, count * sizeof(double)) == 0;
+		if (!same) {
+			warnx("%s: the %s kernel disagrees with the scalar one.", file,
+			      kernels[k]);
+			failures++;
+		}
+
+		report(file, distance->size, "kernel", kernels[k],
+		       same ? seconds : -1);
+	}
+
+	quartet_kernel(ctx, NULL);
+	free(expected);
+	free(actual);
+	return failures;
+}
+
+static int bench(const char *file) {
+	double start = now();
+	matrix distance = load(file);
+	report(file, distance.size, "read_matrix", "-", now() - start);
+
+	tree_s tree;
+	start = now();
+	check(neighbor_joining_rapid(ctx, &distance, &tree));
+	report(file, distance.size, "neighbor_joining", "rapid", now() - start);
+	tree_free(&tree);
+
+	start = now();
+	check(neighbor_joining(ctx, &distance, &tree));
+	report(file, distance.size, "neighbor_joining", "classic", now() - start);
+
+	start = now();
+	check(quartet_all(ctx, &distance, &tree));
+	report(file, distance.size, "quartet_all", "-", now() - start);
+
+	char *buffer;
+	size_t length;
+	FILE *out = open_memstream(&buffer, &length);
+	if (!out) err(1, "open_memstream");
+
+	start = now();
+	if (newick_sv(ctx, out, &tree.root, distance.names) != 0) {
+		errx(1, "Out of memory");
+	}
+	fflush(out);
+	report(file, distance.size, "newick_sv", "-", now() - start);
+	fclose(out);
+	free(buffer);
+
+	int failures = check_kernels(file, &distance, &tree);
+
+	tree_free(&tree);
+	matrix_free(&distance);
+	return failures;
+}
+
+static _Noreturn void usage(int exit_code) {
+	fprintf(exit_code ? stderr : stdout,
+	        "Usage: afra-bench [-t THREADS] MATRIX...\n"
+	        "Time reading, neighbor joining, the support values and the "
+	        "output of every matrix.\n"
+	        "  -t THREADS  space separated numbers of threads; default: 1\n");
+	exit(exit_code);
+}
+
+int main(int argc, char *argv[]) {
+	const char *thread_list = "1";
+
+	int c;
+	while ((c = getopt(argc, argv, "ht:")) != -1) {
+		switch (c) {
+		case 't':
+			thread_list = optarg;
+			break;
+		case 'h':
+			usage(EXIT_SUCCESS);
+		default:
+			usage(EXIT_FAILURE);
+		}
+	}
+
+	if (optind == argc) usage(EXIT_FAILURE);
+
+	ctx = afra_new(NULL);
+	if (!ctx) err(errno, "Out of memory");
+
+	printf("matrix\ttaxa\tthreads\tphase\tdetail\tseconds\n");
+
+	int failures = 0;
+	for (int i = optind; i < argc; i++) {
+		const char *ptr = thread_list;
+
+		while (*ptr) {
+			char *end;
+			errno = 0;
+			long threads = strtol(ptr, &end, 10);
+			if (errno || end == ptr || threads < 1) {
+				errx(1, "invalid list of threads '%s'.", thread_list);
+			}
+			ptr = end + strspn(end, " ,");
+
+			ctx->threads = threads;
+			// the kernels split branches differently for each thread count
+			failures += bench(argv[i]);
+		}
+	}
+
+	afra_free(ctx);
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
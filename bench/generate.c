@@ -0,0 +1,157 @@
+/*
+ * Copyright (C) 2015 - 2016  Fabian Klötzl
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Generate a distance matrix for benchmarking: a random tree is grown by
+ * joining random pairs of clusters, the additive distances along it are
+ * perturbed by multiplicative noise and printed in PHYLIP format. */
+
+#include <err.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static uint64_t splitmix64(uint64_t *state) {
+	uint64_t z = (*state += 0x9e3779b97f4a7c15);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+	return z ^ (z >> 31);
+}
+
+/** @brief A uniform random number in [0, 1). */
+static double uniform(uint64_t *state) {
+	return (splitmix64(state) >> 11) * 0x1.0p-53;
+}
+
+static unsigned long parse_number(const char *str, const char *what) {
+	errno = 0;
+	char *end;
+	unsigned long value = strtoul(str, &end, 10);
+	if (errno || end == str || *end != '\0') {
+		errx(1, "expected a number for %s, but '%s' was given.", what, str);
+	}
+	return value;
+}
+
+static _Noreturn void usage(int exit_code) {
+	fprintf(exit_code ? stderr : stdout,
+	        "Usage: afra-generate [-s SEED] [-n NOISE] TAXA\n"
+	        "Print a noisy additive distance matrix of a random tree with "
+	        "TAXA leaves.\n"
+	        "  -s SEED   seed of the random tree; default: 0\n"
+	        "  -n NOISE  relative noise in percent; default: 10\n");
+	exit(exit_code);
+}
+
+int main(int argc, char *argv[]) {
+	uint64_t state = 0;
+	double noise = 0.1;
+
+	int c;
+	while ((c = getopt(argc, argv, "hs:n:")) != -1) {
+		switch (c) {
+		case 's':
+			state = parse_number(optarg, "-s");
+			break;
+		case 'n':
+			noise = parse_number(optarg, "-n") / 100.0;
+			break;
+		case 'h':
+			usage(EXIT_SUCCESS);
+		default:
+			usage(EXIT_FAILURE);
+		}
+	}
+
+	if (optind + 1 != argc) usage(EXIT_FAILURE);
+	size_t size = parse_number(argv[optind], "TAXA");
+	if (size < 4) errx(1, "at least four taxa are needed.");
+
+	double *distance = malloc(size * size * sizeof(double));
+	double *height = malloc(size * sizeof(double));
+	/* The members of every cluster as a linked list. cluster[] holds the first
+	 * member of each unjoined cluster, last[] the last one of a list. */
+	size_t *cluster = malloc(size * sizeof(size_t));
+	size_t *next = malloc(size * sizeof(size_t));
+	size_t *last = malloc(size * sizeof(size_t));
+	if (!distance || !height || !cluster || !next || !last) {
+		err(errno, "Out of memory");
+	}
+
+	const size_t end = (size_t)-1;
+	for (size_t i = 0; i < size; i++) {
+		distance[i * size + i] = 0;
+		height[i] = 0;
+		cluster[i] = i;
+		next[i] = end;
+		last[i] = i;
+	}
+
+	for (size_t n = size; n > 1; n--) {
+		size_t x = splitmix64(&state) % n;
+		size_t y = splitmix64(&state) % (n - 1);
+		if (y >= x) y++;
+
+		double x_length = 0.05 + uniform(&state);
+		double y_length = 0.05 + uniform(&state);
+
+		size_t X = cluster[x], Y = cluster[y];
+		for (size_t i = X; i != end; i = next[i]) {
+			for (size_t j = Y; j != end; j = next[j]) {
+				double d = height[i] + x_length + y_length + height[j];
+				distance[i * size + j] = distance[j * size + i] = d;
+			}
+		}
+
+		for (size_t i = X; i != end; i = next[i]) {
+			height[i] += x_length;
+		}
+		for (size_t j = Y; j != end; j = next[j]) {
+			height[j] += y_length;
+		}
+
+		// merge Y into X, move the last cluster into the place of Y
+		next[last[X]] = Y;
+		last[X] = last[Y];
+		cluster[y] = cluster[n - 1];
+		if (x == n - 1) x = y;
+		cluster[x] = X;
+	}
+
+	printf("%zu\n", size);
+	for (size_t i = 0; i < size; i++) {
+		printf("T%zu", i);
+		for (size_t j = 0; j < size; j++) {
+			double d = distance[i * size + j];
+			if (i < j) {
+				d *= 1 + noise * (2 * uniform(&state) - 1);
+				distance[i * size + j] = distance[j * size + i] = d;
+			}
+			printf(" %.6f", d);
+		}
+		printf("\n");
+	}
+
+	free(distance);
+	free(height);
+	free(cluster);
+	free(next);
+	free(last);
+
+	return EXIT_SUCCESS;
+}
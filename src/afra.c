@@ -28,18 +28,166 @@
 #include <omp.h>
 #endif
 
+#include "afra.h"
+#include "batch.h"
+#include "checkpoint.h"
 #include "config.h"
+#include "consense.h"
 #include "io.h"
 #include "matrix.h"
 #include "graph.h"
 #include "quartet.h"
-
-int THREADS = 1;
+#include "serve.h"
+#include "stats.h"
 
 void usage(int);
 void version(void);
 
-void consense(char **matrix_names, matrix distance, tree_root root);
+enum {
+	OPT_SEED = 256,
+	OPT_NJ,
+	OPT_PACKED,
+	OPT_FLOAT,
+	OPT_STATS,
+	OPT_CHECKPOINT,
+	OPT_RESUME,
+	OPT_SERVE,
+	OPT_TREE,
+	OPT_KERNEL,
+	OPT_SHARD,
+	OPT_MERGE
+};
+
+enum mode { QUARTET, CONSENSE, CONVERT };
+
+typedef struct analysis {
+	enum mode mode;
+	afra_ctx *ctx;
+	consensus *replicates;
+} analysis;
+
+/** @brief Compute the support values of a tree and write the result.
+ *
+ * @returns 0 on success, or -1 on error; the message is in the context.
+ */
+static int annotate(const analysis *job, matrix *distance, tree_s *tree,
+                    FILE *out) {
+	afra_ctx *ctx = job->ctx;
+
+	stats_timer timer = stats_start(ctx->stats);
+	if (quartet_all(ctx, distance, tree) != 0) return -1;
+	stats_stop(ctx->stats, STATS_SUPPORT, timer);
+
+	// a shard only writes its branches to the checkpoint
+	if (ctx->shards) return 0;
+
+	timer = stats_start(ctx->stats);
+	int check = job->mode == CONSENSE
+	                ? consense(ctx, out, distance->names, *distance, tree)
+	                : newick_sv(ctx, out, &tree->root, distance->names);
+	stats_stop(ctx->stats, STATS_OUTPUT, timer);
+
+	if (check != 0) {
+		return afra_fail(ctx, AFRA_ERROR_IO, "write error: %s",
+		                 strerror(errno));
+	}
+	return 0;
+}
+
+/** @brief Build the tree of one matrix, compute its support values and write
+ * the result.
+ *
+ * @returns 0 on success, or -1 on error; the message is in the context.
+ */
+static int analyse(size_t index, matrix *distance, FILE *out, void *data) {
+	const analysis *job = data;
+	afra_ctx *ctx = job->ctx;
+
+	tree_s tree;
+	stats_timer timer = stats_start(ctx->stats);
+	int check = ctx->nj == AFRA_NJ_RAPID
+	                ? neighbor_joining_rapid(ctx, distance, &tree)
+	                : neighbor_joining(ctx, distance, &tree);
+	if (check != 0) return -1;
+	stats_stop(ctx->stats, STATS_NJ, timer);
+
+	if (job->replicates) {
+		consensus_add(job->replicates, distance, &tree, index);
+		tree_free(&tree);
+		return 0;
+	}
+
+	check = annotate(job, distance, &tree, out);
+	tree_free(&tree);
+	return check;
+}
+
+/** @brief Compute the support values of the given trees instead of the
+ * neighbor joining tree.
+ *
+ * All trees share one cache, so a branch found in several of them is only
+ * counted once.
+ *
+ * @param job - The analysis.
+ * @param file_name - The matrix file, or NULL for stdin.
+ * @param tree_files - A NULL terminated list of Newick files, each holding
+ * one or more trees.
+ */
+static void annotate_trees(const analysis *job, const char *file_name,
+                           char **tree_files) {
+	afra_ctx *ctx = job->ctx;
+	FILE *file_ptr = stdin;
+
+	if (file_name) {
+		file_ptr = fopen(file_name, "r");
+		if (!file_ptr) err(1, "%s", file_name);
+	} else {
+		file_name = "stdin";
+	}
+
+	matrix distance;
+	stats_timer timer = stats_start(ctx->stats);
+	if (read_matrix(ctx, file_ptr, ctx->flags, &distance) != 0) {
+		errx(1, "%s", afra_message(ctx));
+	}
+	stats_stop(ctx->stats, STATS_PARSE, timer);
+	fclose(file_ptr);
+
+	if (distance.size < 4) {
+		errx(1, "%s: this program requires at least four taxa.", file_name);
+	}
+
+	support_cache cache;
+	if (support_cache_init(&cache) != 0) {
+		err(errno, "Out of memory");
+	}
+	ctx->cache = &cache;
+
+	for (; *tree_files; tree_files++) {
+		FILE *in = fopen(*tree_files, "r");
+		if (!in) err(1, "%s", *tree_files);
+
+		for (size_t number = 1;; number++) {
+			tree_s tree;
+			int check = newick_read(ctx, in, &distance, &tree);
+			if (check > 0) break;
+			if (check < 0) {
+				errx(1, "%s: tree %zu: %s", *tree_files, number,
+				     afra_message(ctx));
+			}
+
+			check = annotate(job, &distance, &tree, stdout);
+			tree_free(&tree);
+			if (check != 0) errx(1, "%s", afra_message(ctx));
+		}
+
+		fclose(in);
+	}
+
+	ctx->cache = NULL;
+	support_cache_free(&cache);
+	matrix_free(&distance);
+}
 
 int main(int argc, char *argv[]) {
 
@@ -48,17 +196,41 @@ int main(int argc, char *argv[]) {
 	    {"mode", required_argument, NULL, 'm'},
 	    {"help", no_argument, NULL, 'h'},
 	    {"threads", required_argument, NULL, 't'},
+	    {"samples", required_argument, NULL, 's'},
+	    {"seed", required_argument, NULL, OPT_SEED},
+	    {"nj", required_argument, NULL, OPT_NJ},
+	    {"packed", no_argument, NULL, OPT_PACKED},
+	    {"float", no_argument, NULL, OPT_FLOAT},
+	    {"stats", optional_argument, NULL, OPT_STATS},
+	    {"checkpoint", required_argument, NULL, OPT_CHECKPOINT},
+	    {"resume", no_argument, NULL, OPT_RESUME},
+	    {"serve", optional_argument, NULL, OPT_SERVE},
+	    {"tree", required_argument, NULL, OPT_TREE},
+	    {"kernel", required_argument, NULL, OPT_KERNEL},
+	    {"shard", required_argument, NULL, OPT_SHARD},
+	    {"merge", required_argument, NULL, OPT_MERGE},
 	    {0, 0, 0, 0}};
 
-#ifdef _OPENMP
 	// Use all available processors by default.
-	THREADS = omp_get_num_procs();
-#endif
+	afra_ctx *ctx = afra_new(NULL);
+	if (!ctx) err(errno, "Out of memory");
 
-	enum { QUARTET, CONSENSE } mode = QUARTET;
+	analysis job = {.mode = QUARTET, .ctx = ctx};
+	int want_stats = 0;
+	const char *stats_file = NULL;
+	const char *checkpoint_file = NULL;
+	int resume = 0;
+	int want_serve = 0;
+	const char *serve_socket = NULL;
+	char **tree_files = calloc(argc, sizeof(*tree_files));
+	CHECK_MALLOC(tree_files);
+	size_t tree_count = 0;
+	char **merge_files = calloc(argc, sizeof(*merge_files));
+	CHECK_MALLOC(merge_files);
+	size_t merge_count = 0;
 
 	while (1) {
-		int c = getopt_long(argc, argv, "Vhm:t:", long_options, NULL);
+		int c = getopt_long(argc, argv, "Vhm:s:t:", long_options, NULL);
 		if (c == -1) {
 			break;
 		}
@@ -70,12 +242,14 @@ int main(int argc, char *argv[]) {
 			usage(EXIT_SUCCESS);
 		case 'm':
 			if (strcmp(optarg, "quartet") == 0) {
-				mode = QUARTET;
+				job.mode = QUARTET;
 			} else if (strcmp(optarg, "consense") == 0) {
-				mode = CONSENSE;
+				job.mode = CONSENSE;
+			} else if (strcmp(optarg, "convert") == 0) {
+				job.mode = CONVERT;
 			} else {
-				errx(1,
-				     "invalid mode. Should be one of 'quartet' or 'consense'.");
+				errx(1, "invalid mode. Should be one of 'quartet', 'consense' "
+				        "or 'convert'.");
 			}
 			break;
 		case 't': {
@@ -99,7 +273,7 @@ int main(int argc, char *argv[]) {
 				break;
 			}
 
-			THREADS = threads;
+			ctx->threads = threads;
 #else
 			warnx("This version of afra was built without OpenMP and thus "
 			      "does not support multi threading. Ignoring -t argument.");
@@ -107,6 +281,100 @@ int main(int argc, char *argv[]) {
 			break;
 		}
 
+		case 's': {
+			errno = 0;
+			char *end;
+			unsigned long long samples = strtoull(optarg, &end, 10);
+
+			if (errno || end == optarg || *end != '\0' || optarg[0] == '-') {
+				errx(1, "Expected a positive number for -s argument, but "
+				        "'%s' was given.",
+				     optarg);
+			}
+
+			ctx->samples = samples;
+			break;
+		}
+		case OPT_PACKED:
+			ctx->flags |= MATRIX_PACKED;
+			break;
+		case OPT_FLOAT:
+			ctx->flags |= MATRIX_FLOAT;
+			break;
+		case OPT_STATS:
+			want_stats = 1;
+			stats_file = optarg;
+			break;
+		case OPT_CHECKPOINT:
+			checkpoint_file = optarg;
+			break;
+		case OPT_RESUME:
+			resume = 1;
+			break;
+		case OPT_SERVE:
+			want_serve = 1;
+			serve_socket = optarg;
+			break;
+		case OPT_TREE:
+			tree_files[tree_count++] = optarg;
+			break;
+		case OPT_KERNEL:
+			if (quartet_kernel(ctx, optarg) != 0) {
+				errx(1, "invalid or unsupported kernel '%s'. Should be one of "
+				        "'scalar', 'avx2', 'avx512', 'mixed' or 'sorted'.",
+				     optarg);
+			}
+			break;
+		case OPT_SHARD: {
+			errno = 0;
+			char *end;
+			unsigned long shard = strtoul(optarg, &end, 10), shards = 0;
+
+			if (end != optarg && *end == '/') {
+				char *rest = end + 1;
+				shards = strtoul(rest, &end, 10);
+				if (end == rest) shards = 0;
+			}
+
+			if (errno || *end != '\0' || strchr(optarg, '-') || shard < 1 ||
+			    shard > shards) {
+				errx(1, "Expected --shard I/N with 1 <= I <= N, but '%s' was "
+				        "given.",
+				     optarg);
+			}
+
+			ctx->shard = shard - 1;
+			ctx->shards = shards;
+			break;
+		}
+		case OPT_MERGE:
+			merge_files[merge_count++] = optarg;
+			break;
+		case OPT_NJ:
+			if (strcmp(optarg, "classic") == 0) {
+				ctx->nj = AFRA_NJ_CLASSIC;
+			} else if (strcmp(optarg, "rapid") == 0) {
+				ctx->nj = AFRA_NJ_RAPID;
+			} else {
+				errx(1, "invalid neighbor joining variant. Should be one of "
+				        "'classic' or 'rapid'.");
+			}
+			break;
+		case OPT_SEED: {
+			errno = 0;
+			char *end;
+			unsigned long seed = strtoul(optarg, &end, 10);
+
+			if (errno || end == optarg || *end != '\0') {
+				errx(1, "Expected a number for --seed argument, but '%s' "
+				        "was given.",
+				     optarg);
+			}
+
+			ctx->seed = seed;
+			break;
+		}
+
 		case '?': /* intentional fall-through */
 		default:
 			usage(EXIT_FAILURE);
@@ -115,59 +383,189 @@ int main(int argc, char *argv[]) {
 
 	argv += optind;
 
-	int firsttime = 1;
+	if (resume && !checkpoint_file) {
+		errx(1, "--resume requires a --checkpoint file.");
+	}
+
+	if (want_serve && (*argv || job.mode == CONVERT)) {
+		errx(1, "--serve reads matrices from stdin or a socket and cannot be "
+		        "used with files or convert mode.");
+	}
+
+	if (tree_count &&
+	    (want_serve || job.mode == CONVERT || argc - optind > 1)) {
+		errx(1, "--tree expects a single matrix and cannot be used with "
+		        "--serve or convert mode.");
+	}
+
+	if (ctx->shards && !checkpoint_file) {
+		errx(1, "--shard requires a --checkpoint file to write its branches "
+		        "to.");
+	}
+
+	if (ctx->shards && (want_serve || job.mode == CONVERT ||
+	                    (job.mode == CONSENSE && argc - optind > 1))) {
+		errx(1, "--shard cannot be used with --serve, convert mode or the "
+		        "consensus of several matrices.");
+	}
+
+	if (merge_count &&
+	    (checkpoint_file || ctx->shards || want_serve || job.mode == CONVERT)) {
+		errx(1, "--merge cannot be used with --checkpoint, --shard, --serve or "
+		        "convert mode.");
+	}
 
-	for (;; firsttime = 0) {
-		FILE *file_ptr;
-		const char *file_name;
-		if (!*argv) {
-			if (!firsttime) break;
+	if (!*argv && !serve_socket && isatty(STDIN_FILENO)) {
+		// Tell user we are expecting input …
+		warnx("no file name given; expecting distance matrix input via stdin.");
+	}
 
-			file_ptr = stdin;
-			file_name = "stdin";
+	if (job.mode == CONVERT) {
+		if (argc - optind > 1) {
+			errx(1, "convert mode expects a single matrix.");
+		}
+		if (isatty(STDOUT_FILENO)) {
+			errx(1, "refusing to write a binary matrix to a terminal.");
+		}
 
-			if (isatty(STDIN_FILENO)) {
-				// Tell user we are expecting input …
-				warnx("no file name given; expecting distance matrix input via stdin.");
+		FILE *file_ptr = stdin;
+		if (*argv) {
+			file_ptr = fopen(*argv, "r");
+			if (!file_ptr) err(1, "%s", *argv);
+		}
+
+		matrix distance;
+		if (read_matrix(ctx, file_ptr, ctx->flags, &distance) != 0) {
+			errx(1, "%s", afra_message(ctx));
+		}
+		if (write_binary_matrix(stdout, &distance) != 0) {
+			err(1, "stdout");
+		}
+		fclose(file_ptr);
+		matrix_free(&distance);
+		afra_free(ctx);
+		return EXIT_SUCCESS;
+	}
+
+	stats run_stats;
+	if (want_stats) {
+		if (stats_init(&run_stats, ctx->threads) != 0) {
+			err(errno, "Out of memory");
+		}
+		ctx->stats = &run_stats;
+	}
+
+	checkpoint run_checkpoint;
+	if (checkpoint_file) {
+		int check =
+		    checkpoint_open(ctx, &run_checkpoint, checkpoint_file, resume);
+		if (check != 0) errx(1, "%s", afra_message(ctx));
+		ctx->checkpoint = &run_checkpoint;
+	} else if (merge_count) {
+		run_checkpoint = (checkpoint){};
+		for (size_t i = 0; i < merge_count; i++) {
+			if (checkpoint_merge(ctx, &run_checkpoint, merge_files[i]) != 0) {
+				errx(1, "%s", afra_message(ctx));
 			}
-		} else {
-			file_name = *argv++;
-			file_ptr = fopen(file_name, "r");
-			if (!file_ptr) err(1, "%s", file_name);
 		}
+		ctx->checkpoint = &run_checkpoint;
+	}
 
-		matrix distance = read_matrix(file_ptr);
+	progress run_progress;
+	progress_init(&run_progress);
+	ctx->progress = &run_progress;
 
-		if (distance.size < 4) {
-			errx(1, "this program requires at least four taxa.");
+	if (job.mode == CONSENSE && argc - optind > 1) {
+		// several matrices are replicates of one data set
+		consensus replicates;
+		if (consensus_init(&replicates, ctx->threads) != 0) {
+			err(errno, "Out of memory");
 		}
+		job.replicates = &replicates;
+
+		batch_run(ctx, argv, analyse, &job);
+
+		stats_timer timer = stats_start(ctx->stats);
+		consensus_print(stdout, &replicates);
+		stats_stop(ctx->stats, STATS_OUTPUT, timer);
 
-		tree_s tree;
-		neighbor_joining(&distance, &tree);
-		quartet_all(&distance, &tree);
+		consensus_free(&replicates);
+	} else if (tree_count) {
+		annotate_trees(&job, *argv, tree_files);
+	} else if (want_serve) {
+		serve(ctx, serve_socket, analyse, &job);
+	} else {
+		batch_run(ctx, argv, analyse, &job);
+	}
 
-		if (mode == CONSENSE) {
-			consense(distance.names, distance, tree.root);
-		} else {
-			newick_sv(&tree.root, distance.names);
+	if (ctx->checkpoint) {
+		if (checkpoint_close(ctx, ctx->checkpoint) != 0) {
+			errx(1, "%s", afra_message(ctx));
 		}
+	}
 
-		fclose(file_ptr);
-		tree_free(&tree);
-		matrix_free(&distance);
+	if (ctx->stats && stats_file) {
+		FILE *out = fopen(stats_file, "w");
+		if (!out) err(1, "%s", stats_file);
+		stats_json(out, ctx->stats);
+		if (fclose(out) != 0) err(1, "%s", stats_file);
+	} else if (ctx->stats) {
+		stats_print(stderr, ctx->stats);
+	}
+
+	if (ctx->stats) {
+		stats_free(ctx->stats);
 	}
 
+	free(tree_files);
+	free(merge_files);
+	afra_free(ctx);
 	return EXIT_SUCCESS;
 }
 
 void usage(int exit_code) {
 	static const char *str = {
-	    "Usage: afra [-Vh] [-t INT] [-m quartet|consense] [MATRIX...]\n"
+	    "Usage: afra [-Vh] [-s INT] [-t INT] [-m quartet|consense|convert] [MATRIX...]\n"
 	    "\tMATRIX... can be any sequence of matrices in PHYLIP format. If no "
 	    "files are supplied, stdin is used instead.\n"
 	    "Options:\n"
-	    "  -m, --mode <quartet|consense>\n"
-	    "                    Analysis mode; default: quartet\n"
+	    "  -m, --mode <quartet|consense|convert>\n"
+	    "                    Analysis mode; default: quartet. Given several "
+	    "matrices, consense computes the majority-rule consensus of their "
+	    "trees. convert writes "
+	    "the matrix in afra's binary format to stdout; such files are mapped "
+	    "into memory instead of being parsed.\n"
+	    "      --packed      Only store the lower triangle of the matrix\n"
+	    "      --float       Store distances with single precision\n"
+	    "      --nj <classic|rapid>\n"
+	    "                    Neighbor joining search; rapid skips most pairs "
+	    "using sorted rows, but builds the same tree; default: classic\n"
+	    "  -s, --samples int Estimate support values from this many random "
+	    "quartets per branch and report 95% confidence intervals\n"
+	    "      --seed int    Seed for the random quartets; default: 0\n"
+	    "      --kernel <scalar|avx2|avx512|mixed|sorted>\n"
+	    "                    How quartets are counted; mixed compares in single "
+	    "precision and rechecks near ties; sorted counts each branch in "
+	    "O(n^3 log n) instead of O(n^4) time, also when threads split a "
+	    "branch by the taxa of one class, and pays off for classes of several "
+	    "hundred taxa; default: the widest vector unit\n"
+	    "      --stats[=FILE]\n"
+	    "                    Report time per phase, quartets per second, busy "
+	    "time per thread, the most expensive branches and peak memory; to "
+	    "stderr, or as JSON to FILE\n"
+	    "      --checkpoint FILE\n"
+	    "                    Save the support of completed branches to FILE\n"
+	    "      --resume      Reuse the branches saved in the checkpoint file\n"
+	    "      --shard I/N   Only compute the I-th of N parts of the branches, "
+	    "and save them to the checkpoint file instead of writing a tree\n"
+	    "      --merge FILE  Write the tree from the checkpoint files of all "
+	    "shards instead of computing the support; may be repeated\n"
+	    "      --serve[=SOCKET]\n"
+	    "                    Keep running and analyse a stream of matrices from "
+	    "stdin, or from connections to a UNIX domain socket; one result is "
+	    "written per matrix\n"
+	    "      --tree FILE   Compute the support of the Newick trees in FILE "
+	    "instead of the neighbor joining tree; may be repeated\n"
 	    "  -t, --threads int Number of threads; by default all processors are "
 	    "used.\n"
 	    "  -h, --help        Display this help and exit\n"
@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2015 - 2016  Fabian Klötzl
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The library interface of afra. All state lives in a context; contexts are
+ * independent of each other, so different threads may run analyses at the
+ * same time, each with its own context. Functions return AFRA_OK or one of
+ * the error codes below; a description of the last error is kept in the
+ * context. */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdio.h>
+
+enum afra_error {
+	AFRA_OK = 0,
+	/** Memory could not be allocated. */
+	AFRA_ERROR_MEMORY,
+	/** Reading or writing a file failed. */
+	AFRA_ERROR_IO,
+	/** The input is not a valid distance matrix. */
+	AFRA_ERROR_FORMAT,
+	/** The matrix has fewer than four taxa. */
+	AFRA_ERROR_TAXA,
+	/** A function was called with an invalid argument. */
+	AFRA_ERROR_ARGUMENT,
+};
+
+/** The neighbor joining variants; both build the same tree. */
+enum afra_nj { AFRA_NJ_CLASSIC, AFRA_NJ_RAPID };
+
+/** Storage flags of matrices. By default, the full square matrix is stored
+ * with double precision. */
+enum {
+	/** Only store the lower triangle. */
+	AFRA_PACKED = 1,
+	/** Store single precision values. */
+	AFRA_FLOAT = 2,
+};
+
+/** Allocation functions for the memory handed out by the library. `data` is
+ * passed on to both. */
+typedef struct afra_allocator {
+	void *(*malloc)(size_t size, void *data);
+	void (*free)(void *ptr, void *data);
+	void *data;
+} afra_allocator;
+
+typedef struct afra_ctx afra_ctx;
+typedef struct afra_matrix afra_matrix;
+
+/** A node of an annotated tree. The tree is unrooted and drawn from node 0,
+ * which has three children. All other inner nodes have two children, leaves
+ * none. Branches are described by the node below them. */
+typedef struct afra_node {
+	/** The name of a leaf, or NULL for inner nodes. */
+	const char *name;
+	/** The row of a leaf in the distance matrix. */
+	size_t taxon;
+	size_t parent;
+	size_t children[3];
+	size_t child_count;
+	/** The length of the branch to the parent. */
+	double length;
+	/** The support of the branch to the parent and its 95% confidence
+	 * interval. NAN for leaves and node 0. Without sampling all three are
+	 * equal. */
+	double support, lower, upper;
+} afra_node;
+
+typedef struct afra_tree {
+	size_t node_count;
+	afra_node *nodes;
+	/** The storage of the names. */
+	char *names;
+} afra_tree;
+
+afra_ctx *afra_new(const afra_allocator *);
+void afra_free(afra_ctx *);
+
+int afra_set_threads(afra_ctx *, int threads);
+int afra_set_samples(afra_ctx *, size_t samples, unsigned long seed);
+int afra_set_nj(afra_ctx *, enum afra_nj);
+int afra_set_storage(afra_ctx *, int flags);
+int afra_set_kernel(afra_ctx *, const char *name);
+
+const char *afra_message(const afra_ctx *);
+const char *afra_strerror(int error);
+
+int afra_matrix_read(afra_ctx *, FILE *in, afra_matrix **);
+int afra_matrix_new(afra_ctx *, size_t size, const char *const *names,
+                    const double *distances, afra_matrix **);
+size_t afra_matrix_size(const afra_matrix *);
+void afra_matrix_free(afra_ctx *, afra_matrix *);
+
+int afra_support(afra_ctx *, const afra_matrix *, afra_tree *);
+void afra_tree_free(afra_ctx *, afra_tree *);
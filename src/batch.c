@@ -0,0 +1,181 @@
+/*
+ * Copyright (C) 2015 - 2016  Fabian Klötzl
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "batch.h"
+#include "global.h"
+#include "io.h"
+#include "matrix.h"
+#include "stats.h"
+
+/* Runs of small matrices are analysed as OpenMP tasks. One thread reads the
+ * input and creates a task per matrix, so reading the next matrix overlaps
+ * with the analysis of the previous ones. Each task writes to its own memory
+ * stream; the reading thread passes finished results to stdout in input
+ * order. Large matrices end the run and are analysed on their own with all
+ * threads, as before. */
+
+typedef struct batch_job {
+	size_t index;
+	matrix distance;
+	char *buffer;
+	size_t size;
+	int done;
+} batch_job;
+
+typedef struct batch_queue {
+	batch_job *jobs;
+	size_t capacity, head, tail;
+} batch_queue;
+
+static void job_run(afra_ctx *ctx, batch_job *job, batch_fn fn, void *data) {
+	FILE *out = open_memstream(&job->buffer, &job->size);
+	if (!out) err(1, "open_memstream");
+
+	if (fn(job->index, &job->distance, out, data) != 0) {
+		errx(1, "%s", afra_message(ctx));
+	}
+
+	if (fclose(out) != 0) err(1, "open_memstream");
+	matrix_free(&job->distance);
+
+#pragma omp atomic write seq_cst
+	job->done = 1;
+}
+
+/** @brief Write the results of the finished jobs at the front of the queue.
+ *
+ * @param queue - The queue.
+ * @param wait - Whether all jobs are known to be finished.
+ */
+static void queue_flush(batch_queue *queue, int wait) {
+	while (queue->head < queue->tail) {
+		batch_job *job = &queue->jobs[queue->head % queue->capacity];
+
+		int done;
+#pragma omp atomic read seq_cst
+		done = job->done;
+
+		if (!done && !wait) break;
+
+		if (fwrite(job->buffer, 1, job->size, stdout) != job->size) {
+			err(1, "stdout");
+		}
+		free(job->buffer);
+		queue->head++;
+	}
+}
+
+static matrix read_next(afra_ctx *ctx, char ***files) {
+	FILE *file_ptr = stdin;
+	const char *file_name = "stdin";
+
+	if (**files) {
+		file_name = *(*files)++;
+		file_ptr = fopen(file_name, "r");
+		if (!file_ptr) err(1, "%s", file_name);
+	}
+
+	matrix distance;
+	stats_timer timer = stats_start(ctx->stats);
+	if (read_matrix(ctx, file_ptr, ctx->flags, &distance) != 0) {
+		errx(1, "%s", afra_message(ctx));
+	}
+	stats_stop(ctx->stats, STATS_PARSE, timer);
+	fclose(file_ptr);
+
+	if (distance.size < 4) {
+		errx(1, "%s: this program requires at least four taxa.", file_name);
+	}
+
+	return distance;
+}
+
+/** @brief Analyse all matrices, writing the results in input order.
+ *
+ * @param ctx - The context; matrices are read with its storage flags.
+ * @param files - A NULL terminated list of file names. If empty, a single
+ * matrix is read from stdin.
+ * @param fn - The analysis.
+ * @param data - Passed on to `fn`.
+ */
+void batch_run(afra_ctx *ctx, char **files, batch_fn fn, void *data) {
+	int use_stdin = !*files;
+
+	batch_queue queue = {.capacity = 4 * ctx->threads};
+	queue.jobs = malloc(queue.capacity * sizeof(batch_job));
+	CHECK_MALLOC(queue.jobs);
+
+#ifdef _OPENMP
+	// Analyses inside tasks run on a single thread each.
+	omp_set_max_active_levels(1);
+#endif
+
+	size_t index = 0;
+
+	while (use_stdin || *files) {
+		matrix large = {};
+
+#pragma omp parallel num_threads(ctx->threads)
+#pragma omp single
+		{
+			while (use_stdin || *files) {
+				matrix distance = read_next(ctx, &files);
+				use_stdin = 0;
+
+				if (distance.size >= BATCH_SMALL) {
+					large = distance;
+					break;
+				}
+
+				if (queue.tail - queue.head == queue.capacity) {
+#pragma omp taskwait
+					queue_flush(&queue, 1);
+				}
+
+				batch_job *job = &queue.jobs[queue.tail++ % queue.capacity];
+				*job = (batch_job){.index = index++, .distance = distance};
+
+#pragma omp task firstprivate(job)
+				job_run(ctx, job, fn, data);
+
+				queue_flush(&queue, 0);
+			}
+
+#pragma omp taskwait
+			queue_flush(&queue, 1);
+		}
+
+		if (large.size) {
+			if (fn(index++, &large, stdout, data) != 0) {
+				errx(1, "%s", afra_message(ctx));
+			}
+			matrix_free(&large);
+		}
+	}
+
+	free(queue.jobs);
+}
@@ -0,0 +1,33 @@
+/*
+ * Copyright (C) 2015 - 2016  Fabian Klötzl
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdio.h>
+
+#include "global.h"
+#include "matrix.h"
+
+/** Matrices with fewer taxa are analysed concurrently, one per thread. */
+#define BATCH_SMALL 256
+
+/** A function analysing the matrix at position `index` of the input and
+ * writing its result to `out`. It returns 0 on success, or -1 on error with
+ * the message in the context. */
+typedef int (*batch_fn)(size_t index, matrix *distance, FILE *out,
+                        void *data);
+
+void batch_run(afra_ctx *, char **files, batch_fn fn, void *data);
@@ -0,0 +1,174 @@
+/*
+ * Copyright (C) 2015 - 2016  Fabian Klötzl
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <math.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "buffer.h"
+
+/** @brief Make room for `bytes` more characters.
+ *
+ * @returns a pointer to the end of the buffer, or NULL if out of memory. The
+ * caller writes there and increments the length.
+ */
+char *buffer_reserve(buffer *buf, size_t bytes) {
+	if (buf->failed) return NULL;
+
+	if (!buf->data || buf->length + bytes > buf->capacity) {
+		size_t capacity = buf->capacity ? buf->capacity : 4096;
+		while (buf->length + bytes > capacity) {
+			capacity *= 2;
+		}
+
+		char *data = realloc(buf->data, capacity);
+		if (!data) {
+			buf->failed = 1;
+			return NULL;
+		}
+		buf->data = data;
+		buf->capacity = capacity;
+	}
+
+	return buf->data + buf->length;
+}
+
+void buffer_write(buffer *buf, const char *str, size_t length) {
+	char *ptr = buffer_reserve(buf, length);
+	if (!ptr) return;
+	memcpy(ptr, str, length);
+	buf->length += length;
+}
+
+void buffer_puts(buffer *buf, const char *str) {
+	buffer_write(buf, str, strlen(str));
+}
+
+void buffer_putc(buffer *buf, char c) {
+	char *ptr = buffer_reserve(buf, 1);
+	if (!ptr) return;
+	*ptr = c;
+	buf->length++;
+}
+
+static size_t format_size(char *ptr, size_t value) {
+	char digits[20];
+	size_t count = 0;
+	do {
+		digits[count++] = '0' + value % 10;
+		value /= 10;
+	} while (value);
+
+	for (size_t i = 0; i < count; i++) {
+		ptr[i] = digits[count - 1 - i];
+	}
+	return count;
+}
+
+/** @brief Append a number in decimal. */
+void buffer_size(buffer *buf, size_t value) {
+	char *ptr = buffer_reserve(buf, 20);
+	if (!ptr) return;
+	buf->length += format_size(ptr, value);
+}
+
+/** @brief Append a number with a fixed number of decimals, exactly as
+ * printf's "%.*f" would.
+ *
+ * The number is scaled and rounded to an integer. Below 2^32 the error of the
+ * scaling is smaller than 1e-6, so the rounding can only go wrong for values
+ * very close to a half. Those, and large or special values, are left to
+ * printf.
+ *
+ * @param buf - The buffer.
+ * @param value - The number.
+ * @param decimals - The number of decimals; at most six.
+ */
+void buffer_fixed(buffer *buf, double value, int decimals) {
+	static const uint64_t scale[] = {1, 10, 100, 1000, 10000, 100000, 1000000};
+
+	double scaled = fabs(value) * scale[decimals];
+	double whole = floor(scaled);
+	double fraction = scaled - whole;
+
+	if (!(scaled < 4294967296.0) || fabs(fraction - 0.5) < 1e-6) {
+		buffer_printf(buf, "%.*f", decimals, value);
+		return;
+	}
+
+	char *ptr = buffer_reserve(buf, 32);
+	if (!ptr) return;
+	char *start = ptr;
+
+	uint64_t rounded = (uint64_t)whole + (fraction > 0.5);
+	if (signbit(value)) *ptr++ = '-';
+	ptr += format_size(ptr, rounded / scale[decimals]);
+
+	if (decimals) {
+		*ptr++ = '.';
+		uint64_t digits = rounded % scale[decimals];
+		for (int i = decimals - 1; i >= 0; i--) {
+			ptr[i] = '0' + digits % 10;
+			digits /= 10;
+		}
+		ptr += decimals;
+	}
+
+	buf->length += ptr - start;
+}
+
+void buffer_printf(buffer *buf, const char *format, ...) {
+	va_list args;
+	va_start(args, format);
+	char *ptr = buffer_reserve(buf, 64);
+	int length = ptr ? vsnprintf(ptr, 64, format, args) : -1;
+	va_end(args);
+
+	if (length < 0) {
+		buf->failed = 1;
+		return;
+	}
+
+	if (length >= 64) {
+		ptr = buffer_reserve(buf, length + 1);
+		if (!ptr) return;
+		va_start(args, format);
+		vsnprintf(ptr, length + 1, format, args);
+		va_end(args);
+	}
+
+	buf->length += length;
+}
+
+/** @brief Write the buffer to a stream with a single call and empty it.
+ *
+ * @returns 0 on success, or -1 if the buffer ran out of memory. Write errors
+ * are left in the error indicator of the stream.
+ */
+int buffer_flush(buffer *buf, FILE *out) {
+	if (buf->failed) return -1;
+	if (buf->length) fwrite(buf->data, 1, buf->length, out);
+	buf->length = 0;
+	return 0;
+}
+
+void buffer_free(buffer *buf) {
+	free(buf->data);
+	*buf = (buffer){};
+}
@@ -0,0 +1,40 @@
+/*
+ * Copyright (C) 2015 - 2016  Fabian Klötzl
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdio.h>
+
+/** A growable character buffer. Output is built here and written at once,
+ * instead of with one stdio call per token. Running out of memory is
+ * remembered in `failed`; further appends are ignored. */
+typedef struct buffer {
+	char *data;
+	size_t length, capacity;
+	int failed;
+} buffer;
+
+char *buffer_reserve(buffer *, size_t bytes);
+void buffer_write(buffer *, const char *str, size_t length);
+void buffer_puts(buffer *, const char *str);
+void buffer_putc(buffer *, char c);
+void buffer_size(buffer *, size_t value);
+void buffer_fixed(buffer *, double value, int decimals);
+void buffer_printf(buffer *, const char *format, ...)
+    __attribute__((format(printf, 2, 3)));
+int buffer_flush(buffer *, FILE *out);
+void buffer_free(buffer *);
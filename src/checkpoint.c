@@ -0,0 +1,353 @@
+/*
+ * Copyright (C) 2015 - 2016  Fabian Klötzl
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "checkpoint.h"
+#include "global.h"
+
+static const char checkpoint_magic[] = "afra checkpoint 1\n";
+
+/** Completed branches are written to disk at least this often, in seconds. */
+#define CHECKPOINT_INTERVAL 30
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int compare_records(const void *a, const void *b) {
+	const checkpoint_record *x = a, *y = b;
+	if (x->key != y->key) return x->key < y->key ? -1 : 1;
+	return x->id < y->id ? -1 : x->id > y->id;
+}
+
+static int file_error(afra_ctx *ctx, const char *file_name) {
+	return afra_fail(ctx, AFRA_ERROR_IO, "%s: %s", file_name, strerror(errno));
+}
+
+/** @brief Read the records of an existing checkpoint file and add them to
+ * the ones already loaded. A partially written last line, as left by a
+ * preempted run, is ignored.
+ *
+ * @returns 0 on success, or -1 on error.
+ */
+static int checkpoint_load(afra_ctx *ctx, checkpoint *cp, FILE *in) {
+	char *line = NULL;
+	size_t capacity = 0, allocated = cp->record_count;
+	ssize_t length = getline(&line, &capacity, in);
+	int check = 0;
+
+	if (length >= 0 && strcmp(line, checkpoint_magic) != 0) {
+		check = afra_fail(ctx, AFRA_ERROR_FORMAT,
+		                  "%s: not an afra checkpoint", cp->file_name);
+	}
+
+	while (!check && (length = getline(&line, &capacity, in)) > 0) {
+		if (line[length - 1] != '\n') break;
+
+		checkpoint_record record;
+		if (sscanf(line, "%" SCNx64 " %zu %la %la %la", &record.key,
+		           &record.id, &record.support, &record.lower,
+		           &record.upper) != 5) {
+			check = afra_fail(ctx, AFRA_ERROR_FORMAT, "%s: corrupt checkpoint",
+			                  cp->file_name);
+			break;
+		}
+
+		if (cp->record_count == allocated) {
+			allocated = allocated ? 2 * allocated : 1024;
+			checkpoint_record *records =
+			    realloc(cp->records, allocated * sizeof(checkpoint_record));
+			if (!records) {
+				check = afra_fail(ctx, AFRA_ERROR_MEMORY, "Out of memory");
+				break;
+			}
+			cp->records = records;
+		}
+		cp->records[cp->record_count++] = record;
+	}
+
+	if (!check && ferror(in)) check = file_error(ctx, cp->file_name);
+	free(line);
+
+	qsort(cp->records, cp->record_count, sizeof(checkpoint_record),
+	      compare_records);
+	return check;
+}
+
+/** @brief Write the magic line and all loaded records to a new file, and
+ * replace the checkpoint file with it.
+ *
+ * @returns 0 on success, or -1 on error.
+ */
+static int checkpoint_rewrite(afra_ctx *ctx, checkpoint *cp,
+                              const char *temp_name) {
+	cp->file = fopen(temp_name, "w");
+	if (!cp->file) return file_error(ctx, temp_name);
+
+	// rewrite the complete records, dropping a partial last line
+	fputs(checkpoint_magic, cp->file);
+	for (size_t i = 0; i < cp->record_count; i++) {
+		checkpoint_save(cp, &cp->records[i]);
+	}
+
+	int check = checkpoint_flush(cp) || fsync(fileno(cp->file));
+	check = fclose(cp->file) || check;
+	cp->file = NULL;
+	if (check) return file_error(ctx, temp_name);
+
+	if (rename(temp_name, cp->file_name) != 0) {
+		return file_error(ctx, cp->file_name);
+	}
+
+	cp->file = fopen(cp->file_name, "a");
+	return cp->file ? 0 : file_error(ctx, cp->file_name);
+}
+
+/** @brief Open a checkpoint file.
+ *
+ * The complete records are first written to FILE.tmp, which then replaces
+ * the file. A run preempted at any point thus leaves either the old or the
+ * new records behind, never a truncated file.
+ *
+ * @param ctx - The context; errors are recorded here.
+ * @param cp - The checkpoint; to be closed even on error.
+ * @param file_name - The file to write to.
+ * @param resume - If set, the branches stored in an existing file are
+ * reused and new ones are appended. Otherwise the file is truncated.
+ * @returns 0 on success, or -1 on error.
+ */
+int checkpoint_open(afra_ctx *ctx, checkpoint *cp, const char *file_name,
+                    int resume) {
+	*cp = (checkpoint){.file_name = file_name, .last_flush = now()};
+
+	FILE *in = resume ? fopen(file_name, "r") : NULL;
+	if (in) {
+		int check = checkpoint_load(ctx, cp, in);
+		fclose(in);
+		if (check) return -1;
+	} else if (resume && errno != ENOENT) {
+		return file_error(ctx, file_name);
+	}
+
+	size_t length = strlen(file_name);
+	char *temp_name = malloc(length + sizeof(".tmp"));
+	if (!temp_name) return afra_fail(ctx, AFRA_ERROR_MEMORY, "Out of memory");
+	memcpy(temp_name, file_name, length);
+	memcpy(temp_name + length, ".tmp", sizeof(".tmp"));
+
+	int check = checkpoint_rewrite(ctx, cp, temp_name);
+	free(temp_name);
+	return check;
+}
+
+/** @brief Add the records of a shard to a checkpoint without a file. Merged
+ * checkpoints are only read from; the support phase fails on a branch none
+ * of the shards computed.
+ *
+ * @param ctx - The context; errors are recorded here.
+ * @param cp - The checkpoint; zeroed before the first shard.
+ * @param file_name - The checkpoint file written by the shard.
+ * @returns 0 on success, or -1 on error.
+ */
+int checkpoint_merge(afra_ctx *ctx, checkpoint *cp, const char *file_name) {
+	FILE *in = fopen(file_name, "r");
+	if (!in) return file_error(ctx, file_name);
+
+	cp->file_name = file_name;
+	int check = checkpoint_load(ctx, cp, in);
+	fclose(in);
+	return check;
+}
+
+/** @brief Close the file of a checkpoint and free its records.
+ *
+ * @returns 0 on success, or -1 if the file cannot be written.
+ */
+int checkpoint_close(afra_ctx *ctx, checkpoint *cp) {
+	int check = 0;
+	if (cp->file && fclose(cp->file) != 0) {
+		check = file_error(ctx, cp->file_name);
+	}
+	free(cp->records);
+	*cp = (checkpoint){};
+	return check;
+}
+
+static uint64_t mix(uint64_t hash, uint64_t value) {
+	hash = (hash ^ value) * 0xbf58476d1ce4e5b9;
+	return hash ^ (hash >> 31);
+}
+
+static uint64_t mix_double(uint64_t hash, double value) {
+	uint64_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	return mix(hash, bits);
+}
+
+static uint64_t mix_node(uint64_t hash, const tree_s *tree,
+                         const tree_node *node) {
+	return mix(hash, node ? (uint64_t)(node - tree->pool) : UINT64_MAX);
+}
+
+/** @brief Hash everything the support values depend on: the distances and
+ * names, the topology of the tree and the sampling parameters.
+ */
+uint64_t checkpoint_key(const afra_ctx *ctx, const matrix *distance,
+                        const tree_s *tree) {
+	size_t size = distance->size;
+	uint64_t hash = mix(0x9e3779b97f4a7c15, size);
+
+	for (size_t i = 0; i < size; i++) {
+		for (const char *c = distance->names[i]; *c; c++) {
+			hash = mix(hash, (unsigned char)*c);
+		}
+		for (size_t j = 0; j < size; j++) {
+			hash = mix_double(hash, MATRIX_CELL(*distance, i, j));
+		}
+	}
+
+	for (size_t i = 0; i < 2 * tree->size; i++) {
+		const tree_node *node = &tree->pool[i];
+		hash = mix_node(hash, tree, node->left_branch);
+		hash = mix_node(hash, tree, node->right_branch);
+		hash = mix(hash, node->index);
+	}
+	hash = mix_node(hash, tree, tree->root.left_branch);
+	hash = mix_node(hash, tree, tree->root.right_branch);
+	hash = mix_node(hash, tree, tree->root.extra_branch);
+
+	hash = mix(hash, ctx->samples);
+	hash = mix(hash, ctx->seed);
+
+	return hash;
+}
+
+/** @brief Look up a completed branch.
+ *
+ * @returns 1 if the branch was found, 0 otherwise.
+ */
+int checkpoint_find(const checkpoint *cp, uint64_t key, size_t id,
+                    checkpoint_record *record) {
+	checkpoint_record needle = {.key = key, .id = id};
+	const checkpoint_record *found =
+	    cp->record_count ? bsearch(&needle, cp->records, cp->record_count,
+	                               sizeof(checkpoint_record), compare_records)
+	                     : NULL;
+	if (!found) return 0;
+
+	*record = *found;
+	return 1;
+}
+
+/** @brief Append a completed branch. The file is flushed every
+ * CHECKPOINT_INTERVAL seconds. Thread-safe.
+ *
+ * @returns 0 on success, or -1 if the file cannot be written.
+ */
+int checkpoint_save(checkpoint *cp, const checkpoint_record *record) {
+	int check = 0;
+
+#pragma omp critical(checkpoint)
+	{
+		fprintf(cp->file, "%016" PRIx64 " %zu %a %a %a\n", record->key,
+		        record->id, record->support, record->lower, record->upper);
+
+		if (now() - cp->last_flush >= CHECKPOINT_INTERVAL) {
+			check = checkpoint_flush(cp);
+		}
+	}
+
+	return check;
+}
+
+/** @brief Write all saved branches to disk.
+ *
+ * @returns 0 on success, or -1 if the file cannot be written.
+ */
+int checkpoint_flush(checkpoint *cp) {
+	cp->last_flush = now();
+	return fflush(cp->file) != 0 ? -1 : 0;
+}
+
+/* Progress of the support phase, reported on SIGUSR1. The signal handler only
+ * sets a flag; the report is printed by the next thread finishing a piece of
+ * work. */
+
+static volatile sig_atomic_t progress_requested = 0;
+
+static void progress_signal(int signum) {
+	(void)signum;
+	progress_requested = 1;
+}
+
+/** @brief Report the progress on SIGUSR1. */
+void progress_init(progress *pg) {
+	*pg = (progress){.start = now()};
+
+	struct sigaction action = {.sa_handler = progress_signal};
+	sigemptyset(&action.sa_mask);
+	action.sa_flags = SA_RESTART;
+	sigaction(SIGUSR1, &action, NULL);
+}
+
+/** @brief Add branches and their quartets to the work to do. */
+void progress_add(progress *pg, size_t branches, size_t quartets) {
+	if (!pg) return;
+#pragma omp atomic
+	pg->branches += branches;
+#pragma omp atomic
+	pg->quartets += quartets;
+}
+
+/** @brief Mark work as done, and print the progress if it was asked for. */
+void progress_done(progress *pg, size_t branches, size_t quartets) {
+	if (!pg) return;
+#pragma omp atomic
+	pg->branches_done += branches;
+#pragma omp atomic
+	pg->quartets_done += quartets;
+
+	if (!progress_requested) return;
+
+#pragma omp critical(progress)
+	if (progress_requested) {
+		progress_requested = 0;
+
+		size_t branches_done, quartets_done;
+#pragma omp atomic read
+		branches_done = pg->branches_done;
+#pragma omp atomic read
+		quartets_done = pg->quartets_done;
+
+		double percent =
+		    pg->quartets ? 100.0 * quartets_done / pg->quartets : 100.0;
+		fprintf(stderr,
+		        "afra: %zu of %zu branches done, %.1f%% of the quartets, "
+		        "%.0f s elapsed\n",
+		        branches_done, pg->branches, percent, now() - pg->start);
+	}
+}
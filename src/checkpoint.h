@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2015 - 2016  Fabian Klötzl
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "global.h"
+#include "graph.h"
+#include "matrix.h"
+
+/** A completed branch, as stored in a checkpoint file. */
+typedef struct checkpoint_record {
+	uint64_t key;
+	size_t id;
+	double support, lower, upper;
+} checkpoint_record;
+
+/** Checkpoints of the support phase. Completed branches are appended to a
+ * text file, one line per branch, keyed by a hash of the matrix, the tree and
+ * the sampling parameters. A checkpoint without a file holds the merged
+ * records of several shards; see checkpoint_merge(). */
+typedef struct checkpoint {
+	FILE *file;
+	const char *file_name;
+	double last_flush;
+	checkpoint_record *records;
+	size_t record_count;
+} checkpoint;
+
+int checkpoint_open(afra_ctx *, checkpoint *, const char *file_name,
+                    int resume);
+int checkpoint_merge(afra_ctx *, checkpoint *, const char *file_name);
+int checkpoint_close(afra_ctx *, checkpoint *);
+uint64_t checkpoint_key(const afra_ctx *, const matrix *, const tree_s *);
+int checkpoint_find(const checkpoint *, uint64_t key, size_t id,
+                    checkpoint_record *);
+int checkpoint_save(checkpoint *, const checkpoint_record *);
+int checkpoint_flush(checkpoint *);
+
+/** The progress of the support phase, reported on SIGUSR1. */
+typedef struct progress {
+	size_t branches, branches_done;
+	size_t quartets, quartets_done;
+	double start;
+} progress;
+
+void progress_init(progress *);
+void progress_add(progress *, size_t branches, size_t quartets);
+void progress_done(progress *, size_t branches, size_t quartets);
@@ -14,119 +14,651 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <err.h>
 #include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "buffer.h"
+#include "consense.h"
 #include "matrix.h"
 #include "global.h"
 #include "graph.h"
-#include "quartet.h"
 
-void print_species(char **names, size_t n);
-int set_root(matrix *distance, tree_root *root);
+/** A row of a set listing: the taxa of a set as stars and dots, followed by
+ * how often the set occurs. */
+typedef struct set_row {
+	const uint64_t *bits;
+	double count;
+} set_row;
+
+typedef struct set_ctx {
+	tree_clades clades;
+	set_row *rows;
+	size_t count;
+} set_ctx;
+
+void print_species(buffer *out, char **names, size_t n);
+int set_root(set_ctx *ctx, tree_root *root);
+static void print_rows(buffer *out, const set_row *rows, size_t count,
+                       size_t size, int threads);
+
+int consense(const afra_ctx *actx, FILE *out, char **matrix_names,
+             matrix distance, tree_s *tree) {
+	buffer buf = {};
+	buffer_puts(&buf, "\nConsensus tree program, version 3.695\n\n");
+
+	print_species(&buf, matrix_names, distance.size);
+
+	buffer_puts(&buf,
+	            "\n\n\nSets included in the consensus tree\n\n"
+	            "Set (species in order)     How many times out of  100.00\n\n");
+
+	set_ctx ctx = {};
+	if (tree_clades_init(&ctx.clades, tree) != 0) {
+		err(errno, "Out of memory");
+	}
+	ctx.rows = malloc(2 * distance.size * sizeof(set_row));
+	CHECK_MALLOC(ctx.rows);
+
+	set_root(&ctx, &tree->root);
+	print_rows(&buf, ctx.rows, ctx.count, ctx.clades.size, actx->threads);
+
+	free(ctx.rows);
+	tree_clades_free(&ctx.clades);
 
-void consense(char **matrix_names, matrix distance, tree_root root) {
-	printf("\nConsensus tree program, version 3.695\n\n");
+	buffer_puts(&buf, "\n\nSets NOT included in consensus tree: NONE.\n\n");
 
-	print_species(matrix_names, distance.size);
+	if (newick_sv_buffer(actx, &buf, &tree->root, matrix_names) != 0) {
+		err(errno, "Out of memory");
+	}
+	int check = buffer_flush(&buf, out);
+	buffer_free(&buf);
+	return check;
+}
+
+/** @brief Print rows of stars and dots. With n characters for each of up to
+ * n sets, they make up most of the output. So the counts, which differ in
+ * length, are formatted first; then the rows are filled in parallel at their
+ * final offsets.
+ */
+static void print_rows(buffer *out, const set_row *rows, size_t count,
+                       size_t size, int threads) {
+	if (!count) return;
+
+	buffer counts = {};
+	size_t *offset = malloc((count + 1) * sizeof(size_t));
+	CHECK_MALLOC(offset);
+
+	for (size_t r = 0; r < count; r++) {
+		offset[r] = counts.length;
+		buffer_puts(&counts, "                     ");
+		buffer_fixed(&counts, rows[r].count, 1);
+		buffer_putc(&counts, '\n');
+	}
+	offset[count] = counts.length;
 
-	printf("\n\n\nSets included in the consensus tree\n\n"
-	       "Set (species in order)     How many times out of  100.00\n\n");
+	size_t bytes = count * size + counts.length;
+	char *ptr = buffer_reserve(out, bytes);
+	if (!ptr || counts.failed) err(errno, "Out of memory");
 
-	set_root(&distance, &root);
+#pragma omp parallel for num_threads(threads) schedule(static)
+	for (size_t r = 0; r < count; r++) {
+		char *row = ptr + r * size + offset[r];
+		for (size_t i = 0; i < size; i++) {
+			row[i] = clade_has(rows[r].bits, i) ? '*' : '.';
+		}
+		memcpy(row + size, counts.data + offset[r], offset[r + 1] - offset[r]);
+	}
 
-	printf("\n\nSets NOT included in consensus tree: NONE.\n\n");
+	out->length += bytes;
+	buffer_free(&counts);
+	free(offset);
+}
 
-	newick_sv(&root, matrix_names);
+/** @brief Add the clade below a branch as a row, with the support of the
+ * branch. */
+static void set_print(const tree_node *clade, double support, set_ctx *ctx) {
+	ctx->rows[ctx->count++] =
+	    (set_row){CLADE(ctx->clades, clade), support * 100};
 }
 
-void set_left(tree_node *current, matrix *distance) {
+void set_left(tree_node *current, set_ctx *ctx) {
 	if (!current->left_branch || !current->left_branch->left_branch) return;
-	color_context cctx = {.size = distance->size,
-	                      .types = malloc(distance->size),
-	                      .color = SET_A};
-	CHECK_MALLOC(cctx.types);
+	set_print(current->left_branch, current->left_support, ctx);
+}
+
+void set_right(tree_node *current, set_ctx *ctx) {
+	if (!current->left_branch || !current->right_branch->left_branch) return;
+	set_print(current->right_branch, current->right_support, ctx);
+}
 
-	memset(cctx.types, SET_D, distance->size);
-	colorize(current->left_branch, &cctx);
+void set_node(tree_node *current, void *ctx) {
+	if (!current->left_branch) return;
 
-	double d = current->left_support;
+	// left branch
+	set_left(current, (set_ctx *)ctx);
 
-	for (size_t i = 0; i < distance->size; i++) {
-		printf("%c", cctx.types[i] == SET_A ? '*' : '.');
+	// right branch
+	set_right(current, (set_ctx *)ctx);
+}
+
+int set_root(set_ctx *ctx, tree_root *root) {
+	visitor_ctx v = {.pre = NULL, .process = set_node, .post = NULL};
+
+	if (traverse_all(&root->as_tree_node, &v, ctx) != 0 ||
+	    traverse_all(root->extra_branch, &v, ctx) != 0) {
+		err(errno, "Out of memory");
 	}
-	printf("                     %2.1lf\n", d * 100);
 
-	free(cctx.types);
+	if (root->extra_branch->left_branch) {
+		// Support Value for Root→Extra
+		set_print(root->extra_branch, root->extra_support, ctx);
+	}
+
+	return 0;
 }
 
-void set_right(tree_node *current, matrix *distance) {
-	if (!current->left_branch || !current->right_branch->left_branch) return;
-	color_context cctx = {.size = distance->size,
-	                      .types = malloc(distance->size),
-	                      .color = SET_A};
-	CHECK_MALLOC(cctx.types);
+void print_species(buffer *out, char **names, size_t n) {
+	buffer_puts(out, "Species in order:\n\n");
+	for (size_t i = 0; i < n; i++) {
+		buffer_puts(out, "  ");
+		buffer_size(out, i + 1);
+		buffer_puts(out, ". ");
+		buffer_puts(out, names[i]);
+		buffer_putc(out, '\n');
+	}
+}
+
+/* Majority-rule consensus of replicate trees. */
+
+static uint64_t split_hash(const uint64_t *key, size_t words) {
+	uint64_t hash = 0x9e3779b97f4a7c15;
+	for (size_t i = 0; i < words; i++) {
+		hash = (hash ^ key[i]) * 0xbf58476d1ce4e5b9;
+		hash ^= hash >> 31;
+	}
+	return hash;
+}
+
+static void split_table_init(split_table *table, size_t words) {
+	*table = (split_table){.words = words, .capacity = 64};
+	table->keys = calloc(table->capacity * words, sizeof(uint64_t));
+	table->counts = calloc(table->capacity, sizeof(size_t));
+	CHECK_MALLOC(table->keys);
+	CHECK_MALLOC(table->counts);
+}
+
+static void split_table_free(split_table *table) {
+	free(table->keys);
+	free(table->counts);
+	*table = (split_table){};
+}
 
-	memset(cctx.types, SET_D, distance->size);
-	colorize(current->right_branch, &cctx);
+static void split_table_add(split_table *table, const uint64_t *key,
+                            size_t count);
 
-	double d = current->right_support;
+static void split_table_grow(split_table *table) {
+	split_table old = *table;
 
-	for (size_t i = 0; i < distance->size; i++) {
-		printf("%c", cctx.types[i] == SET_A ? '*' : '.');
+	table->capacity *= 2;
+	table->used = 0;
+	table->keys = calloc(table->capacity * table->words, sizeof(uint64_t));
+	table->counts = calloc(table->capacity, sizeof(size_t));
+	CHECK_MALLOC(table->keys);
+	CHECK_MALLOC(table->counts);
+
+	for (size_t i = 0; i < old.capacity; i++) {
+		if (old.counts[i]) {
+			split_table_add(table, old.keys + i * old.words, old.counts[i]);
+		}
 	}
-	printf("                     %2.1lf\n", d * 100);
 
-	free(cctx.types);
+	split_table_free(&old);
 }
 
-void set_node(tree_node *current, void *ctx) {
-	if (!current->left_branch) return;
+/** @brief Add `count` occurrences of a split to the table. */
+static void split_table_add(split_table *table, const uint64_t *key,
+                            size_t count) {
+	if (2 * (table->used + 1) > table->capacity) {
+		split_table_grow(table);
+	}
 
-	// left branch
-	set_left(current, (matrix *)ctx);
+	size_t words = table->words;
+	size_t mask = table->capacity - 1;
+	size_t slot = split_hash(key, words) & mask;
 
-	// right branch
-	set_right(current, (matrix *)ctx);
+	while (table->counts[slot]) {
+		uint64_t *other = table->keys + slot * words;
+		if (memcmp(other, key, words * sizeof(uint64_t)) == 0) {
+			table->counts[slot] += count;
+			return;
+		}
+		slot = (slot + 1) & mask;
+	}
+
+	memcpy(table->keys + slot * words, key, words * sizeof(uint64_t));
+	table->counts[slot] = count;
+	table->used++;
 }
 
-int set_root(matrix *distance, tree_root *root) {
+/** @brief Prepare counting the splits of replicate trees.
+ *
+ * @param tables - The number of threads adding trees concurrently.
+ * @returns 0 iff successful.
+ */
+int consensus_init(consensus *cons, size_t tables) {
+	*cons = (consensus){.table_count = tables};
+	cons->tables = calloc(tables, sizeof(split_table));
+	return cons->tables ? 0 : 1;
+}
 
-	visitor_ctx v = {.pre = NULL, .process = set_node, .post = NULL};
+void consensus_free(consensus *cons) {
+	for (size_t i = 0; i < cons->table_count; i++) {
+		split_table_free(&cons->tables[i]);
+	}
+	for (size_t i = 0; cons->sorted && i < cons->size; i++) {
+		free(cons->sorted[i]);
+	}
+	free(cons->sorted);
+	free(cons->order);
+	free(cons->tables);
+	*cons = (consensus){};
+}
 
-	traverse_all(&root->as_tree_node, &v, distance);
-	traverse_all(root->extra_branch, &v, distance);
+static int compare_names(const void *a, const void *b) {
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
 
-	if (root->extra_branch->left_branch) {
-		// Support Value for Root→Extra
-		color_context cctx = {.size = distance->size,
-		                      .types = malloc(distance->size),
-		                      .color = SET_A};
-		CHECK_MALLOC(cctx.types);
+static void consensus_taxa(consensus *cons, const matrix *distance) {
+	size_t size = distance->size;
 
-		memset(cctx.types, SET_D, distance->size);
-		colorize(root->extra_branch, &cctx);
+	cons->size = size;
+	cons->words = (size + 63) / 64;
+	cons->sorted = malloc(size * sizeof(char *));
+	CHECK_MALLOC(cons->sorted);
+
+	for (size_t i = 0; i < size; i++) {
+		cons->sorted[i] = strdup(distance->names[i]);
+		CHECK_MALLOC(cons->sorted[i]);
+	}
 
-		double d = root->extra_support;
+	qsort(cons->sorted, size, sizeof(char *), compare_names);
 
-		for (size_t i = 0; i < distance->size; i++) {
-			printf("%c", cctx.types[i] == SET_A ? '*' : '.');
+	for (size_t i = 1; i < size; i++) {
+		if (strcmp(cons->sorted[i - 1], cons->sorted[i]) == 0) {
+			errx(1, "taxon '%s' occurs twice.", cons->sorted[i]);
 		}
-		printf("                     %2.1lf\n", d * 100);
+	}
 
-		free(cctx.types);
+	for (size_t i = 0; i < cons->table_count; i++) {
+		split_table_init(&cons->tables[i], cons->words);
 	}
+}
 
-	return 0;
+typedef struct split_ctx {
+	consensus *cons;
+	split_table *table;
+	const size_t *taxa;
+	tree_clades clades;
+	uint64_t *key;
+} split_ctx;
+
+/** @brief Count the split separating the clade below `clade` from the rest.
+ */
+static void split_add(tree_node *clade, split_ctx *ctx) {
+	if (!clade || !clade->left_branch) return;
+
+	size_t size = ctx->cons->size, words = ctx->cons->words;
+	const uint64_t *bits = CLADE(ctx->clades, clade);
+
+	// renumber the taxa
+	memset(ctx->key, 0, words * sizeof(uint64_t));
+	for (size_t w = 0; w < words; w++) {
+		for (uint64_t word = bits[w]; word; word &= word - 1) {
+			size_t taxon = ctx->taxa[w * 64 + __builtin_ctzll(word)];
+			ctx->key[taxon / 64] |= UINT64_C(1) << (taxon % 64);
+		}
+	}
+
+	if (ctx->key[0] & 1) {
+		for (size_t w = 0; w < words; w++) {
+			ctx->key[w] = ~ctx->key[w];
+		}
+		if (size % 64) {
+			ctx->key[words - 1] &= (UINT64_C(1) << (size % 64)) - 1;
+		}
+	}
+
+	split_table_add(ctx->table, ctx->key, 1);
 }
 
-void print_species(char **names, size_t n) {
-	printf("Species in order:\n\n");
-	for (size_t i = 0; i < n; i++) {
-		printf("  %zu. %s\n", i + 1, names[i]);
+static void split_node(tree_node *current, void *ctx) {
+	split_add(current->left_branch, ctx);
+	split_add(current->right_branch, ctx);
+}
+
+/** @brief Count the splits of one replicate tree. May be called from several
+ * threads at once.
+ *
+ * @param cons - The consensus.
+ * @param distance - The matrix the tree was built from.
+ * @param tree - The tree.
+ * @param index - The number of the replicate; the taxa are reported in the
+ * order of replicate 0.
+ */
+void consensus_add(consensus *cons, const matrix *distance, tree_s *tree,
+                   size_t index) {
+#pragma omp critical(consensus_taxa)
+	if (!cons->sorted) {
+		consensus_taxa(cons, distance);
+	}
+
+	size_t size = cons->size;
+	if (distance->size != size) {
+		errx(1, "replicate %zu has %zu taxa instead of %zu.", index + 1,
+		     distance->size, size);
+	}
+
+	size_t *taxa = malloc(size * sizeof(size_t));
+	CHECK_MALLOC(taxa);
+
+	for (size_t i = 0; i < size; i++) {
+		char **found = bsearch(&distance->names[i], cons->sorted, size,
+		                       sizeof(char *), compare_names);
+		if (!found) {
+			errx(1, "replicate %zu has the unknown taxon '%s'.", index + 1,
+			     distance->names[i]);
+		}
+		taxa[i] = found - cons->sorted;
+	}
+
+	size_t thread = 0;
+#ifdef _OPENMP
+	thread = omp_get_thread_num();
+#endif
+
+	split_ctx ctx = {.cons = cons,
+	                 .table = &cons->tables[thread],
+	                 .taxa = taxa,
+	                 .key = malloc(cons->words * sizeof(uint64_t))};
+	CHECK_MALLOC(ctx.key);
+	if (tree_clades_init(&ctx.clades, tree) != 0) {
+		err(errno, "Out of memory");
+	}
+
+	tree_root *root = &tree->root;
+	visitor_ctx v = {.pre = NULL, .process = split_node, .post = NULL};
+	if (traverse_all(&root->as_tree_node, &v, &ctx) != 0 ||
+	    traverse_all(root->extra_branch, &v, &ctx) != 0) {
+		err(errno, "Out of memory");
+	}
+	split_add(root->extra_branch, &ctx);
+
+	tree_clades_free(&ctx.clades);
+	free(ctx.key);
+
+	if (index == 0) {
+		cons->order = taxa;
+	} else {
+		free(taxa);
 	}
+
+#pragma omp atomic
+	cons->trees++;
+}
+
+/** A split in the order of the reported taxa. */
+typedef struct split_entry {
+	uint64_t *key;
+	size_t count;
+	size_t taxa;
+} split_entry;
+
+static int bit(const uint64_t *key, size_t i) {
+	return (key[i / 64] >> (i % 64)) & 1;
+}
+
+static int compare_entries(const void *a, const void *b) {
+	const split_entry *x = a, *y = b;
+	if (x->count != y->count) return x->count < y->count ? 1 : -1;
+
+	// sets with a star further left come first
+	size_t i = 0;
+	while (bit(x->key, i) == bit(y->key, i)) i++;
+	return bit(x->key, i) ? -1 : 1;
+}
+
+static int compare_sizes(const void *a, const void *b) {
+	const split_entry *x = a, *y = b;
+	if (x->taxa != y->taxa) return x->taxa < y->taxa ? 1 : -1;
+	return compare_entries(a, b);
+}
+
+static void print_sets(buffer *out, const split_entry *entries, size_t count,
+                       size_t size, int threads) {
+	set_row *rows = malloc((count + 1) * sizeof(set_row));
+	CHECK_MALLOC(rows);
+
+	for (size_t i = 0; i < count; i++) {
+		rows[i] = (set_row){entries[i].key, entries[i].count};
+	}
+	print_rows(out, rows, count, size, threads);
+
+	free(rows);
+}
+
+/** A node of the consensus tree: a child is either a taxon or a split. */
+typedef struct consensus_child {
+	size_t parent, first;
+	ssize_t split;
+} consensus_child;
+
+static int compare_children(const void *a, const void *b) {
+	const consensus_child *x = a, *y = b;
+	if (x->parent != y->parent) return x->parent < y->parent ? -1 : 1;
+	return x->first < y->first ? -1 : x->first > y->first;
+}
+
+/** @brief Print the nodes of the consensus tree in Newick format. The tree
+ * may be as deep as it has taxa, so an explicit stack is used: for every open
+ * node, its next child to print.
+ */
+static void print_nodes(buffer *out, char **names, const split_entry *splits,
+                        const consensus_child *children, const size_t *begin,
+                        size_t root, size_t trees) {
+	size_t *nodes = malloc((root + 1) * sizeof(size_t));
+	size_t *next = malloc((root + 1) * sizeof(size_t));
+	CHECK_MALLOC(nodes);
+	CHECK_MALLOC(next);
+
+	size_t top = 0;
+	nodes[top] = root;
+	next[top++] = begin[root];
+	buffer_putc(out, '(');
+
+	while (top) {
+		size_t node = nodes[top - 1], k = next[top - 1]++;
+
+		if (k == begin[node + 1]) {
+			buffer_putc(out, ')');
+			if (node != root) {
+				buffer_putc(out, ':');
+				buffer_fixed(out, splits[node].count, 1);
+			}
+			top--;
+			continue;
+		}
+
+		if (k > begin[node]) buffer_putc(out, ',');
+
+		const consensus_child *child = &children[k];
+		if (child->split < 0) {
+			buffer_puts(out, names[child->first]);
+			buffer_putc(out, ':');
+			buffer_fixed(out, trees, 1);
+		} else {
+			buffer_putc(out, '(');
+			nodes[top] = child->split;
+			next[top++] = begin[child->split];
+		}
+	}
+
+	free(nodes);
+	free(next);
+}
+
+/** @brief Print the consensus tree. The included splits are nested by adding
+ * them from large to small; the parent of a split is the smallest split added
+ * before that contains any of its taxa.
+ */
+static void print_consensus_tree(buffer *out, char **names, split_entry *splits,
+                                 size_t count, size_t size, size_t trees) {
+	qsort(splits, count, sizeof(split_entry), compare_sizes);
+
+	size_t root = count;
+	size_t *owner = malloc(size * sizeof(size_t));
+	consensus_child *children =
+	    malloc((size + count) * sizeof(consensus_child));
+	size_t *begin = calloc(count + 2, sizeof(size_t));
+	CHECK_MALLOC(owner);
+	CHECK_MALLOC(children);
+	CHECK_MALLOC(begin);
+
+	for (size_t i = 0; i < size; i++) {
+		owner[i] = root;
+	}
+
+	for (size_t s = 0; s < count; s++) {
+		size_t first = 0;
+		while (!bit(splits[s].key, first)) first++;
+
+		children[s] = (consensus_child){
+		    .parent = owner[first], .first = first, .split = s};
+
+		for (size_t i = first; i < size; i++) {
+			if (bit(splits[s].key, i)) owner[i] = s;
+		}
+	}
+
+	for (size_t i = 0; i < size; i++) {
+		children[count + i] =
+		    (consensus_child){.parent = owner[i], .first = i, .split = -1};
+	}
+
+	qsort(children, size + count, sizeof(consensus_child), compare_children);
+
+	for (size_t k = 0; k < size + count; k++) {
+		begin[children[k].parent + 1]++;
+	}
+	for (size_t node = 0; node <= count; node++) {
+		begin[node + 1] += begin[node];
+	}
+
+	print_nodes(out, names, splits, children, begin, root, trees);
+	buffer_puts(out, ";\n");
+
+	free(owner);
+	free(children);
+	free(begin);
+}
+
+/** @brief Print the majority-rule consensus of all replicates in the style of
+ * PHYLIP consense: the splits occurring in more than half of the trees form
+ * the consensus tree, all others are listed as not included.
+ */
+void consensus_print(FILE *out, consensus *cons) {
+	size_t size = cons->size, words = cons->words;
+	split_table *all = &cons->tables[0];
+
+	for (size_t t = 1; t < cons->table_count; t++) {
+		split_table *table = &cons->tables[t];
+		for (size_t i = 0; i < table->capacity; i++) {
+			if (table->counts[i]) {
+				split_table_add(all, table->keys + i * words,
+				                table->counts[i]);
+			}
+		}
+		split_table_free(table);
+	}
+
+	char **names = malloc(size * sizeof(char *));
+	split_entry *entries = malloc((all->used + 1) * sizeof(split_entry));
+	uint64_t *keys = calloc((all->used + 1) * words, sizeof(uint64_t));
+	CHECK_MALLOC(names);
+	CHECK_MALLOC(entries);
+	CHECK_MALLOC(keys);
+
+	for (size_t i = 0; i < size; i++) {
+		names[i] = cons->sorted[cons->order[i]];
+	}
+
+	// translate the splits to the order of the reported taxa
+	size_t count = 0;
+	for (size_t slot = 0; slot < all->capacity; slot++) {
+		if (!all->counts[slot]) continue;
+
+		const uint64_t *key = all->keys + slot * words;
+		split_entry *entry = &entries[count];
+		*entry = (split_entry){.key = keys + count * words,
+		                       .count = all->counts[slot]};
+		count++;
+
+		int flip = bit(key, cons->order[0]);
+		for (size_t i = 0; i < size; i++) {
+			if (bit(key, cons->order[i]) != flip) {
+				entry->key[i / 64] |= UINT64_C(1) << (i % 64);
+				entry->taxa++;
+			}
+		}
+	}
+
+	qsort(entries, count, sizeof(split_entry), compare_entries);
+
+	size_t included = 0;
+	while (included < count && 2 * entries[included].count > cons->trees) {
+		included++;
+	}
+
+	int threads = cons->table_count;
+	buffer buf = {};
+
+	buffer_puts(&buf, "\nConsensus tree program, version 3.695\n\n");
+	print_species(&buf, names, size);
+
+	buffer_printf(&buf,
+	              "\n\n\nSets included in the consensus tree\n\n"
+	              "Set (species in order)     How many times out of %7.2lf\n\n",
+	              (double)cons->trees);
+	print_sets(&buf, entries, included, size, threads);
+
+	buffer_puts(&buf, "\n\nSets NOT included in consensus tree:");
+	if (included == count) {
+		buffer_puts(&buf, " NONE.\n\n");
+	} else {
+		buffer_printf(&buf,
+		              "\n\nSet (species in order)     How many times out of "
+		              "%7.2lf\n\n",
+		              (double)cons->trees);
+		print_sets(&buf, entries + included, count - included, size, threads);
+		buffer_puts(&buf, "\n\n");
+	}
+
+	print_consensus_tree(&buf, names, entries, included, size, cons->trees);
+
+	if (buffer_flush(&buf, out) != 0) err(errno, "Out of memory");
+	buffer_free(&buf);
+
+	free(names);
+	free(entries);
+	free(keys);
 }
@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2015 - 2016  Fabian Klötzl
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "global.h"
+#include "graph.h"
+#include "matrix.h"
+
+int consense(const afra_ctx *, FILE *out, char **matrix_names,
+             matrix distance, tree_s *tree);
+
+/** A split is stored as a bitset of the taxa on one side. It is normalized to
+ * the side not containing taxon 0, so both sides of a bipartition hash to the
+ * same key. */
+typedef struct split_table {
+	size_t words;
+	size_t capacity, used;
+	uint64_t *keys;
+	size_t *counts;
+} split_table;
+
+/** Counts the splits of replicate trees, one table per thread. Taxa are
+ * identified by name; internally they are numbered in sorted order. */
+typedef struct consensus {
+	size_t size, words;
+	size_t trees;
+	char **sorted;
+	size_t *order;
+	split_table *tables;
+	size_t table_count;
+} consensus;
+
+int consensus_init(consensus *, size_t tables);
+void consensus_add(consensus *, const matrix *distance, tree_s *tree,
+                   size_t index);
+void consensus_print(FILE *out, consensus *);
+void consensus_free(consensus *);
@@ -18,6 +18,11 @@
 
 #pragma once
 
+#include <stddef.h>
+
+#include "afra.h"
+#include "scratch.h"
+
 #define CHECK_MALLOC(PTR)                                                      \
 	do {                                                                       \
 		if ((PTR) == NULL) {                                                   \
@@ -25,4 +30,42 @@
 		}                                                                      \
 	} while (0);
 
-extern int THREADS;
+struct checkpoint;
+struct progress;
+struct quartet_tiles;
+struct stats;
+struct support_cache;
+
+/** The state of an analysis. Everything a phase needs to know besides its
+ * input is passed down in here, so analyses with different contexts do not
+ * interfere. The error is set by the first failing function; see
+ * afra_fail(). */
+struct afra_ctx {
+	int threads;
+	size_t samples;
+	unsigned long seed;
+	/** The storage flags of matrices read. */
+	int flags;
+	enum afra_nj nj;
+	/** The quartet counting kernel, or NULL for the widest one the CPU
+	 * supports; see quartet_kernel(). */
+	size_t (*kernel)(const struct quartet_tiles *);
+	/** If shards is not 0, only the branches of shard number shard, counted
+	 * from 0, are computed; see quartet_all(). */
+	size_t shard, shards;
+	afra_allocator allocator;
+	/** Optional; NULL if not used. */
+	struct stats *stats;
+	struct checkpoint *checkpoint;
+	struct progress *progress;
+	struct support_cache *cache;
+	/** Reused temporary memory; see scratch_get(). */
+	scratch_pool scratch;
+	int error;
+	char message[256];
+};
+
+int afra_fail(afra_ctx *, int error, const char *format, ...)
+    __attribute__((format(printf, 3, 4)));
+int afra_failed(afra_ctx *);
+void afra_clear(afra_ctx *);
@@ -15,8 +15,9 @@
  */
 
 #include <assert.h>
-#include <err.h>
-#include <errno.h>
+#include <ctype.h>
+#include <math.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
@@ -26,10 +27,10 @@
 #include "matrix.h"
 
 int tree_init(tree_s *baum, size_t size) {
-	if (!baum || !size) return 1;
+	if (!baum || !size || size > SIZE_MAX / 2 / sizeof(tree_node)) return 1;
 	*baum = (tree_s){};
 	baum->pool = malloc(2 * size * sizeof(tree_node));
-	CHECK_MALLOC(baum->pool);
+	if (!baum->pool) return 1;
 	memset(baum->pool, 0, 2 * size * sizeof(tree_node));
 	baum->size = size;
 	return 0;
@@ -41,67 +42,414 @@ void tree_free(tree_s *baum) {
 	*baum = (tree_s){};
 }
 
-int neighbor_joining(matrix *distance, tree_s *out_tree) {
-	size_t matrix_size = distance->size;
-	if (matrix_size < 3 || !out_tree) return -2;
-
-	int check;
-
-	check = tree_init(out_tree, matrix_size);
-	if (check) return check;
+/** Below this number of unjoined nodes, the steps of neighbor joining are too
+ * small to be worth spreading over threads. */
+#define NJ_PARALLEL_MIN 512
 
-	tree_node *node_pool = out_tree->pool;
-	tree_node *empty_node_ptr = &node_pool[matrix_size];
-	tree_node **unjoined_nodes = malloc(matrix_size * sizeof(tree_node *));
-	CHECK_MALLOC(unjoined_nodes);
-
-	size_t n = matrix_size;
+/** The best pair found so far. Pairs are ordered by their value and then by
+ * position, so that the same pair as in the exhaustive search is found. */
+typedef struct nj_best {
+	double value;
 	size_t i, j;
+} nj_best;
 
-	for (i = 0; i < n; i++) {
-		node_pool[i] = LEAF(i);
-		unjoined_nodes[i] = &node_pool[i];
+static void nj_consider(nj_best *best, double value, size_t i, size_t j) {
+	if (value < best->value ||
+	    (value == best->value &&
+	     (i < best->i || (i == best->i && j < best->j)))) {
+		*best = (nj_best){value, i, j};
 	}
+}
 
-	double r[matrix_size];
+/* Neighbor joining works on a private copy of the distance matrix with the
+ * same storage flags as the input. The functions below come in two flavors:
+ * one for square double matrices with direct row access, and one for compact
+ * matrices (packed or single precision) that only relies on the part of each
+ * row left of the diagonal being contiguous. */
 
-	matrix local_copy;
-	check = matrix_copy(&local_copy, distance);
-	assert(check == 0);
-	assert(local_copy.size == distance->size);
-	assert(memcmp(local_copy.data, distance->data,
-	              matrix_size * matrix_size * sizeof(double)) == 0);
+#define M(I, J) (MATRIX_CELL(*local, I, J))
 
-#define M(I, J) (MATRIX_CELL(local_copy, I, J))
+/** @brief Set a cell and, for square matrices, its mirror image. */
+static void nj_set(matrix *local, size_t i, size_t j, double value) {
+	matrix_set(local, i, j, value);
+	if (!(local->flags & MATRIX_PACKED)) {
+		matrix_set(local, j, i, value);
+	}
+}
 
-	while (n > 3) {
-		for (i = 0; i < n; i++) {
-			double rr = 0.0;
-			for (j = 0; j < n; j++) {
-				if (i == j) assert(M(i, j) == 0.0);
-				assert(M(i, j) == M(j, i));
+/** @brief Compute the normalized row sums of a compact matrix.
+ *
+ * Row i is summed as M(i,0), …, M(i,n-1), the same order of additions as for
+ * square matrices. A packed matrix only stores M(i,0), …, M(i,i-1) in the
+ * row, so it is followed by M(i,i), …, M(n-1,i) from the column, which are
+ * the same values as the matrix is symmetric.
+ */
+static void nj_row_sums_compact(const matrix *local, size_t n, double *r,
+                                int threads) {
+	const int packed = local->flags & MATRIX_PACKED;
 
+	if (!packed) {
+#pragma omp parallel for schedule(dynamic, 64) num_threads(threads) if (n >= NJ_PARALLEL_MIN)
+		for (size_t i = 0; i < n; i++) {
+			double rr = 0.0;
+			for (size_t j = 0; j < n; j++) {
 				rr += M(i, j);
 			}
 			r[i] = rr / (double)(n - 2);
 		}
+		return;
+	}
+
+#pragma omp parallel for schedule(dynamic, 64) num_threads(threads) if (n >= NJ_PARALLEL_MIN)
+	for (size_t i = 0; i < n; i++) {
+		double rr = 0.0;
+		for (size_t j = 0; j < i; j++) {
+			rr += M(i, j);
+		}
+		r[i] = rr;
+	}
 
-		size_t min_i = 0, min_j = 1;
-		double min_value = M(0, 1) - r[0] - r[1];
+	const size_t block = 512;
 
-		for (i = 0; i < n; i++) {
-			for (j = 0; j < n; j++) {
+#pragma omp parallel for num_threads(threads) if (n >= NJ_PARALLEL_MIN)
+	for (size_t lo = 0; lo < n; lo += block) {
+		size_t hi = lo + block < n ? lo + block : n;
+
+		for (size_t j = lo; j < n; j++) {
+			size_t end = j + 1 < hi ? j + 1 : hi;
+			for (size_t i = lo; i < end; i++) {
+				r[i] += M(j, i);
+			}
+		}
+
+		for (size_t i = lo; i < hi; i++) {
+			r[i] = r[i] / (double)(n - 2);
+		}
+	}
+}
+
+/** @brief Find the pair with the minimal Q value in a compact matrix. A
+ * packed matrix is symmetric, so both orientations of every pair below the
+ * diagonal are evaluated from the same cell. Otherwise every row is scanned
+ * in full. Either way, the result equals the one of nj_search().
+ */
+static nj_best nj_search_compact(const matrix *local, size_t n,
+                                 const double *r, int threads) {
+	const int packed = local->flags & MATRIX_PACKED;
+	nj_best best = {M(0, 1) - r[0] - r[1], 0, 1};
+
+#pragma omp parallel num_threads(threads) if (n >= NJ_PARALLEL_MIN)
+	{
+		nj_best local_best = best;
+
+#pragma omp for schedule(dynamic, 64) nowait
+		for (size_t i = 0; i < n; i++) {
+			if (!packed) {
+				for (size_t j = 0; j < n; j++) {
+					if (i == j) continue;
+
+					double q_ij = M(i, j) - r[i] - r[j];
+					if (q_ij <= local_best.value) {
+						nj_consider(&local_best, q_ij, i, j);
+					}
+				}
+				continue;
+			}
+
+			for (size_t j = 0; j < i; j++) {
+				double value = M(i, j);
+				double q_ij = value - r[i] - r[j];
+				double q_ji = value - r[j] - r[i];
+
+				if (q_ij <= local_best.value) {
+					nj_consider(&local_best, q_ij, i, j);
+				}
+				if (q_ji <= local_best.value) {
+					nj_consider(&local_best, q_ji, j, i);
+				}
+			}
+		}
+
+#pragma omp critical
+		nj_consider(&best, local_best.value, local_best.i, local_best.j);
+	}
+
+	return best;
+}
+
+/** @brief Replace rows min_i and min_j of a compact matrix after a join. See
+ * nj_join() for the layout.
+ */
+static void nj_update_compact(matrix *local, size_t n, size_t min_i,
+                              size_t min_j, const double *row_k, int threads) {
+#pragma omp parallel for num_threads(threads) if (n >= NJ_PARALLEL_MIN)
+	for (size_t m = 0; m < n; m++) {
+		if (m == min_i || m == min_j) continue;
+		nj_set(local, min_i, m, row_k[m]);
+	}
+	nj_set(local, min_i, min_i, 0.0);
+
+	if (min_j == n - 1) return;
+
+#pragma omp parallel for num_threads(threads) if (n >= NJ_PARALLEL_MIN)
+	for (size_t m = 0; m < n - 1; m++) {
+		if (m == min_i || m == min_j) continue;
+		nj_set(local, min_j, m, M(n - 1, m));
+	}
+	nj_set(local, min_j, min_i, row_k[n - 1]);
+	nj_set(local, min_j, min_j, 0.0);
+}
+
+#undef M
+#define M(I, J) (MATRIX_SQUARE_CELL(*local, I, J))
+
+/** The number of rows summed at once by nj_row_sums(). */
+#define NJ_SUM_ROWS 8
+
+/** @brief Compute the normalized row sums of the first n rows.
+ *
+ * Each row is summed from left to right, as the matrix need not be
+ * symmetric. A block of rows is summed at once, so that their independent
+ * additions overlap, while each sum is rounded exactly as in a row-by-row
+ * loop.
+ */
+static void nj_row_sums(const matrix *local, size_t n, double *r,
+                        int threads) {
+	if (local->flags) {
+		nj_row_sums_compact(local, n, r, threads);
+		return;
+	}
+
+#pragma omp parallel for num_threads(threads) if (n >= NJ_PARALLEL_MIN)
+	for (size_t lo = 0; lo < n; lo += NJ_SUM_ROWS) {
+		size_t rows = lo + NJ_SUM_ROWS < n ? NJ_SUM_ROWS : n - lo;
+		double sum[NJ_SUM_ROWS] = {0.0};
+
+		for (size_t j = 0; j < n; j++) {
+			for (size_t k = 0; k < rows; k++) {
+				sum[k] += M(lo + k, j);
+			}
+		}
+
+		for (size_t k = 0; k < rows; k++) {
+			r[lo + k] = sum[k] / (double)(n - 2);
+		}
+	}
+}
+
+/** @brief Find the pair with the minimal Q value by exhaustive search.
+ *
+ * Every thread scans a set of rows. Ties are resolved in favor of the first
+ * pair in row-major order, independent of the number of threads.
+ */
+static nj_best nj_search(const matrix *local, size_t n, const double *r,
+                         int threads) {
+	if (local->flags) {
+		return nj_search_compact(local, n, r, threads);
+	}
+
+	nj_best best = {M(0, 1) - r[0] - r[1], 0, 1};
+
+#pragma omp parallel num_threads(threads) if (n >= NJ_PARALLEL_MIN)
+	{
+		nj_best local_best = best;
+
+#pragma omp for schedule(static) nowait
+		for (size_t i = 0; i < n; i++) {
+			for (size_t j = 0; j < n; j++) {
 				if (i == j) continue;
 
 				double value = M(i, j) - r[i] - r[j];
-				if (value < min_value) {
-					min_i = i;
-					min_j = j;
-					min_value = value;
+				if (value < local_best.value) {
+					local_best = (nj_best){value, i, j};
 				}
 			}
 		}
 
+#pragma omp critical
+		nj_consider(&best, local_best.value, local_best.i, local_best.j);
+	}
+
+	return best;
+}
+
+/** @brief Join the nodes at rows min_i and min_j into a new branch.
+ *
+ * The new node takes the place of min_i in the matrix and in the list of
+ * unjoined nodes, while the last row is moved to min_j.
+ *
+ * @param local - The working copy of the distance matrix.
+ * @param n - The number of unjoined nodes.
+ * @param min_i - The first node to join.
+ * @param min_j - The second node to join; min_i < min_j.
+ * @param r - The normalized row sums.
+ * @param row_k - Scratch space for the distances to the new node.
+ * @param unjoined_nodes - The unjoined nodes, indexed by row.
+ * @param new_node - Space for the new node.
+ * @param threads - The number of threads.
+ */
+static void nj_join(matrix *local, size_t n, size_t min_i, size_t min_j,
+                    const double *r, double *row_k, tree_node **unjoined_nodes,
+                    tree_node *new_node, int threads) {
+	const size_t matrix_size = local->size;
+	const double M_ij = MATRIX_CELL(*local, min_i, min_j);
+
+	tree_node branch = {.left_branch = unjoined_nodes[min_i],
+	                    .right_branch = unjoined_nodes[min_j],
+	                    .left_dist = (M_ij + r[min_i] - r[min_j]) / 2.0,
+	                    .right_dist = (M_ij - r[min_i] + r[min_j]) / 2.0,
+	                    .index = -1};
+
+	*new_node = branch;
+	unjoined_nodes[min_i] = new_node;
+	unjoined_nodes[min_j] = unjoined_nodes[n - 1];
+
+#pragma omp parallel for num_threads(threads) if (n >= NJ_PARALLEL_MIN)
+	for (size_t m = 0; m < n; m++) {
+		if (m == min_i || m == min_j) continue;
+
+		row_k[m] = (MATRIX_CELL(*local, min_i, m) +
+		            MATRIX_CELL(*local, min_j, m) - M_ij) /
+		           2.0;
+		// if( row_k[m] < 0) row_k[m] = 0;
+	}
+
+	if (local->flags) {
+		nj_update_compact(local, n, min_i, min_j, row_k, threads);
+		return;
+	}
+
+	// row_k[min_i] and row_k[min_j] are undefined!
+	row_k[min_i] = 0.0;
+	row_k[min_j] = row_k[n - 1];
+
+	memmove(&M(min_i, 0), row_k, matrix_size * sizeof(double));
+	memmove(&M(min_j, 0), &M((n - 1), 0), matrix_size * sizeof(double));
+
+	M(min_i, min_i) = M(min_j, min_j) = 0.0;
+
+#pragma omp parallel for num_threads(threads) if (n >= NJ_PARALLEL_MIN)
+	for (size_t i = 0; i < n; i++) {
+		M(i, min_i) = M(min_i, i);
+	}
+
+#pragma omp parallel for num_threads(threads) if (n >= NJ_PARALLEL_MIN)
+	for (size_t i = 0; i < n; i++) {
+		M(i, min_j) = M(min_j, i);
+	}
+}
+
+#undef M
+#define M(I, J) (MATRIX_CELL(*local, I, J))
+
+/** @brief Join the three remaining nodes at the root. */
+static void nj_root(const matrix *local, tree_node **unjoined_nodes,
+                    tree_s *out_tree) {
+	tree_root root = {.left_branch = unjoined_nodes[0],
+	                  .right_branch = unjoined_nodes[1],
+	                  .extra_branch = unjoined_nodes[2],
+
+	                  .left_dist = (M(0, 1) + M(0, 2) - M(1, 2)) / 2.0,
+	                  .right_dist = (M(0, 1) + M(1, 2) - M(0, 2)) / 2.0,
+	                  .extra_dist = (M(0, 2) + M(1, 2) - M(0, 1)) / 2.0};
+
+	out_tree->root = root;
+}
+
+#undef M
+
+/** @brief Prepare a tree, the list of unjoined nodes, a working copy of the
+ * distance matrix and scratch space for the row sums for neighbor joining.
+ *
+ * The row sums, the unjoined nodes and the working copy share one buffer of
+ * the scratch pool, starting at `r`. Return it with nj_done(). A symmetric
+ * single precision matrix stays symmetric over all joins, so its working copy
+ * is packed; then the compact functions read each cell only once.
+ */
+static int nj_init(afra_ctx *ctx, const matrix *distance, tree_s *out_tree,
+                   tree_node ***unjoined_nodes, matrix *local_copy,
+                   double **r) {
+	size_t matrix_size = distance->size;
+	if (tree_init(out_tree, matrix_size) != 0) {
+		return afra_fail(ctx, AFRA_ERROR_MEMORY, "Out of memory");
+	}
+
+	size_t r_bytes = 2 * matrix_size * sizeof(double);
+	size_t nodes_bytes = matrix_size * sizeof(tree_node *);
+	int flags = distance->flags;
+	if (flags == MATRIX_FLOAT && matrix_symmetric(distance)) {
+		flags |= MATRIX_PACKED;
+	}
+	size_t data_bytes = matrix_bytes(matrix_size, flags);
+
+	char *buffer =
+	    scratch_get(&ctx->scratch, r_bytes + nodes_bytes + data_bytes);
+	if (!buffer) {
+		tree_free(out_tree);
+		return afra_fail(ctx, AFRA_ERROR_MEMORY, "Out of memory");
+	}
+
+	*r = (double *)buffer;
+	*unjoined_nodes = (tree_node **)(buffer + r_bytes);
+	*local_copy = (matrix){.size = matrix_size,
+	                       .flags = flags,
+	                       .data = buffer + r_bytes + nodes_bytes};
+	if (flags == distance->flags) {
+		memcpy(local_copy->data, distance->data, data_bytes);
+	} else {
+		for (size_t i = 0; i < matrix_size; i++) {
+			for (size_t j = 0; j <= i; j++) {
+				matrix_set(local_copy, i, j, matrix_get(distance, i, j));
+			}
+		}
+	}
+
+	for (size_t i = 0; i < matrix_size; i++) {
+		out_tree->pool[i] = LEAF(i);
+		(*unjoined_nodes)[i] = &out_tree->pool[i];
+	}
+
+	return 0;
+}
+
+static void nj_done(afra_ctx *ctx, double *r) {
+	scratch_put(&ctx->scratch, r);
+}
+
+/** @brief Build a tree by neighbor joining.
+ *
+ * @param ctx - The context.
+ * @param distance - The distance matrix.
+ * @param out_tree - The resulting tree.
+ * @returns 0 on success, or -1 on error.
+ */
+int neighbor_joining(afra_ctx *ctx, const matrix *distance, tree_s *out_tree) {
+	size_t matrix_size = distance->size;
+	if (matrix_size < 3 || !out_tree) {
+		return afra_fail(ctx, AFRA_ERROR_TAXA,
+		                 "neighbor joining requires at least three taxa.");
+	}
+
+	tree_node **unjoined_nodes;
+	matrix local_copy;
+	// row sums and scratch space of nj_join()
+	double *r;
+	int check =
+	    nj_init(ctx, distance, out_tree, &unjoined_nodes, &local_copy, &r);
+	if (check) return check;
+
+	tree_node *empty_node_ptr = &out_tree->pool[matrix_size];
+	double *row_k = r + matrix_size;
+	int threads = ctx->threads;
+
+	size_t n = matrix_size;
+
+	while (n > 3) {
+		nj_row_sums(&local_copy, n, r, threads);
+
+		nj_best best = nj_search(&local_copy, n, r, threads);
+		size_t min_i = best.i, min_j = best.j;
+
 		// force i < j
 		if (min_j < min_i) {
 			size_t temp = min_i;
@@ -109,132 +457,927 @@ int neighbor_joining(matrix *distance, tree_s *out_tree) {
 			min_j = temp;
 		}
 
-		tree_node branch = {
-		    .left_branch = unjoined_nodes[min_i],
-		    .right_branch = unjoined_nodes[min_j],
-		    .left_dist = (M(min_i, min_j) + r[min_i] - r[min_j]) / 2.0,
-		    .right_dist = (M(min_i, min_j) - r[min_i] + r[min_j]) / 2.0,
-		    .index = -1};
+		nj_join(&local_copy, n, min_i, min_j, r, row_k, unjoined_nodes,
+		        empty_node_ptr++, threads);
+		n--;
+	}
+
+	nj_root(&local_copy, unjoined_nodes, out_tree);
+
+	nj_done(ctx, r);
+	return 0;
+}
+
+/** An entry of a sorted row. The value is a lower bound of the distance. */
+typedef struct nj_entry {
+	float value;
+	uint32_t id;
+} nj_entry;
+
+typedef struct nj_row {
+	nj_entry *entries;
+	size_t length;
+} nj_row;
 
-		*empty_node_ptr++ = branch;
-		unjoined_nodes[min_i] = empty_node_ptr - 1;
-		unjoined_nodes[min_j] = unjoined_nodes[n - 1];
+static int nj_entry_compare(const void *a, const void *b) {
+	const nj_entry *x = a, *y = b;
+	return (x->value > y->value) - (x->value < y->value);
+}
+
+/** @brief Build the sorted row of the node at position `pos`. Only the n
+ * unjoined nodes are included.
+ *
+ * @returns 0 on success, or -1 if out of memory.
+ */
+static int nj_row_build(nj_row *row, const matrix *local, size_t n,
+                        size_t pos, tree_node **unjoined_nodes,
+                        const tree_node *pool) {
+	row->entries = malloc(n * sizeof(nj_entry));
+	if (!row->entries) return -1;
+	row->length = 0;
+
+	for (size_t m = 0; m < n; m++) {
+		if (m == pos) continue;
+
+		double value = MATRIX_CELL(*local, pos, m);
+		float lower = (float)value;
+		if (lower > value) lower = nextafterf(lower, -INFINITY);
+
+		row->entries[row->length++] =
+		    (nj_entry){lower, unjoined_nodes[m] - pool};
+	}
+
+	qsort(row->entries, row->length, sizeof(nj_entry), nj_entry_compare);
+	return 0;
+}
+
+/** @brief Neighbor joining with the search strategy of RapidNJ.
+ *
+ * Every node keeps a row of its distances to the other nodes, sorted in
+ * ascending order. As Q(i,j) = M(i,j) - r(i) - r(j) >= M(i,j) - r(i) - r_max,
+ * the scan of a row can stop as soon as this bound exceeds the best value
+ * found so far. Rows are never updated; entries of joined nodes are skipped
+ * and the row of a new node covers its distances to all older nodes.
+ *
+ * Row sums, joins and tie breaking are identical to neighbor_joining(), so
+ * the resulting tree is the same.
+ *
+ * @param ctx - The context.
+ * @param distance - The distance matrix.
+ * @param out_tree - The resulting tree.
+ * @returns 0 on success, or -1 on error.
+ */
+int neighbor_joining_rapid(afra_ctx *ctx, const matrix *distance,
+                           tree_s *out_tree) {
+	size_t matrix_size = distance->size;
+	if (matrix_size < 3 || !out_tree) {
+		return afra_fail(ctx, AFRA_ERROR_TAXA,
+		                 "neighbor joining requires at least three taxa.");
+	}
+
+	tree_node **unjoined_nodes;
+	matrix local_copy;
+	// row sums and scratch space of nj_join()
+	double *r;
+	int check =
+	    nj_init(ctx, distance, out_tree, &unjoined_nodes, &local_copy, &r);
+	if (check) return check;
+
+	tree_node *pool = out_tree->pool;
+	tree_node *empty_node_ptr = &pool[matrix_size];
+	double *row_k = r + matrix_size;
+	int threads = ctx->threads;
+
+	size_t n = matrix_size;
+
+	// indexed by the position of a node in the pool
+	nj_row *rows = calloc(2 * matrix_size, sizeof(nj_row));
+	size_t *position = malloc(2 * matrix_size * sizeof(size_t));
+	check = !rows || !position;
 
-		double row_k[matrix_size];
-		double M_ij = M(min_i, min_j);
+	const size_t dead = (size_t)-1;
+	for (size_t id = 0; id < 2 * matrix_size && !check; id++) {
+		position[id] = dead;
+	}
+
+	for (size_t i = 0; i < n && !check; i++) {
+		position[i] = i;
+		check = nj_row_build(&rows[i], &local_copy, n, i, unjoined_nodes, pool);
+	}
 
-		for (size_t m = 0; m < n; m++) {
-			if (m == min_i || m == min_j) continue;
+	size_t compacted_at = n;
 
-			row_k[m] = (M(min_i, m) + M(min_j, m) - M_ij) / 2.0;
-			// if( row_k[m] < 0) row_k[m] = 0;
+#define M(I, J) (MATRIX_CELL(local_copy, I, J))
+
+	while (n > 3 && !check) {
+		nj_row_sums(&local_copy, n, r, threads);
+
+		double r_max = r[0];
+		for (size_t i = 1; i < n; i++) {
+			if (r[i] > r_max) r_max = r[i];
 		}
 
-		// row_k[min_i] and row_k[min_j] are undefined!
-		row_k[min_i] = 0.0;
-		row_k[min_j] = row_k[n - 1];
+		nj_best best = {M(0, 1) - r[0] - r[1], 0, 1};
 
-		memmove(&M(min_i, 0), row_k, matrix_size * sizeof(double));
-		memmove(&M(min_j, 0), &M((n - 1), 0), matrix_size * sizeof(double));
+		// A good first guess makes the bound effective from the start.
+		for (size_t pi = 0; pi < n; pi++) {
+			const nj_row *row = &rows[unjoined_nodes[pi] - pool];
+			for (size_t k = 0; k < row->length; k++) {
+				size_t pj = position[row->entries[k].id];
+				if (pj == dead) continue;
 
-		M(min_i, min_i) = M(min_j, min_j) = 0.0;
+				nj_consider(&best, M(pi, pj) - r[pi] - r[pj], pi, pj);
+				break;
+			}
+		}
+
+		/* Each thread prunes with its own best pair. That is never better
+		 * than the global one, so no candidate for the minimum is lost. */
+#pragma omp parallel num_threads(threads) if (n >= NJ_PARALLEL_MIN)
+		{
+			nj_best local_best = best;
+
+#pragma omp for schedule(dynamic, 16) nowait
+			for (size_t pi = 0; pi < n; pi++) {
+				const nj_row *row = &rows[unjoined_nodes[pi] - pool];
 
-		for (i = 0; i < n; i++) {
-			M(i, min_i) = M(min_i, i);
+				for (size_t k = 0; k < row->length; k++) {
+					const nj_entry entry = row->entries[k];
+					size_t pj = position[entry.id];
+					if (pj == dead) continue;
+
+					double lower = entry.value;
+					double bound = fmin((lower - r[pi]) - r_max,
+					                    (lower - r_max) - r[pi]);
+					if (bound > local_best.value) break;
+
+					nj_consider(&local_best, M(pi, pj) - r[pi] - r[pj], pi,
+					            pj);
+					nj_consider(&local_best, M(pj, pi) - r[pj] - r[pi], pj,
+					            pi);
+				}
+			}
+
+#pragma omp critical
+			nj_consider(&best, local_best.value, local_best.i, local_best.j);
 		}
 
-		for (i = 0; i < n; i++) {
-			M(i, min_j) = M(min_j, i);
+		size_t min_i = best.i, min_j = best.j;
+
+		// force i < j
+		if (min_j < min_i) {
+			size_t temp = min_i;
+			min_i = min_j;
+			min_j = temp;
 		}
 
+		size_t id_i = unjoined_nodes[min_i] - pool;
+		size_t id_j = unjoined_nodes[min_j] - pool;
+		size_t id_last = unjoined_nodes[n - 1] - pool;
+
+		nj_join(&local_copy, n, min_i, min_j, r, row_k, unjoined_nodes,
+		        empty_node_ptr, threads);
 		n--;
+
+		size_t id_k = empty_node_ptr++ - pool;
+
+		free(rows[id_i].entries);
+		free(rows[id_j].entries);
+		rows[id_i] = rows[id_j] = (nj_row){};
+		position[id_i] = position[id_j] = dead;
+		position[id_k] = min_i;
+		if (min_j < n) position[id_last] = min_j;
+
+		check = nj_row_build(&rows[id_k], &local_copy, n, min_i,
+		                     unjoined_nodes, pool);
+
+		// Drop the entries of joined nodes once a quarter of them is stale.
+		if (4 * n <= 3 * compacted_at) {
+#pragma omp parallel for num_threads(threads) if (n >= NJ_PARALLEL_MIN)
+			for (size_t pi = 0; pi < n; pi++) {
+				nj_row *row = &rows[unjoined_nodes[pi] - pool];
+				size_t length = 0;
+				for (size_t k = 0; k < row->length; k++) {
+					if (position[row->entries[k].id] == dead) continue;
+					row->entries[length++] = row->entries[k];
+				}
+				row->length = length;
+			}
+			compacted_at = n;
+		}
 	}
 
-	// join three remaining nodes
-	tree_root root = {.left_branch = unjoined_nodes[0],
-	                  .right_branch = unjoined_nodes[1],
-	                  .extra_branch = unjoined_nodes[2],
+#undef M
 
-	                  .left_dist = (M(0, 1) + M(0, 2) - M(1, 2)) / 2.0,
-	                  .right_dist = (M(0, 1) + M(1, 2) - M(0, 2)) / 2.0,
-	                  .extra_dist = (M(0, 2) + M(1, 2) - M(0, 1)) / 2.0};
+	if (!check) nj_root(&local_copy, unjoined_nodes, out_tree);
 
-	//*empty_node_ptr++ = root;
-	out_tree->root = root;
+	for (size_t id = 0; rows && id < 2 * matrix_size; id++) {
+		free(rows[id].entries);
+	}
+	free(rows);
+	free(position);
+	nj_done(ctx, r);
 
-	free(unjoined_nodes);
-	matrix_free(&local_copy);
+	if (check) {
+		tree_free(out_tree);
+		return afra_fail(ctx, AFRA_ERROR_MEMORY, "Out of memory");
+	}
 	return 0;
 }
 
-void traverse_all(tree_node *current, visitor_ctx *v, void *context) {
-	if (v->pre) {
-		v->pre(current, context);
+typedef struct traverse_frame {
+	tree_node *node;
+	int state;
+} traverse_frame;
+
+/** @brief Visit all nodes of a subtree. For every node, pre is called before
+ * its left subtree, process between its subtrees and post after its right
+ * subtree. The traversal keeps its own stack on the heap, so that deep trees,
+ * such as caterpillars, do not overflow the call stack.
+ *
+ * @param current - The root of the subtree.
+ * @param v - The callbacks; any of them may be NULL.
+ * @param context - Passed on to the callbacks.
+ * @returns 0 on success, or -1 if out of memory.
+ */
+int traverse_all(tree_node *current, visitor_ctx *v, void *context) {
+	if (!current) return 0;
+
+	traverse_frame local[64];
+	traverse_frame *stack = local;
+	size_t capacity = 64, top = 0;
+
+	stack[top++] = (traverse_frame){.node = current};
+
+	while (top) {
+		traverse_frame *frame = &stack[top - 1];
+		tree_node *node = frame->node, *next = NULL;
+
+		switch (frame->state++) {
+		case 0:
+			if (v->pre) v->pre(node, context);
+			next = node->left_branch;
+			break;
+		case 1:
+			if (v->process) v->process(node, context);
+			next = node->right_branch;
+			break;
+		default:
+			if (v->post) v->post(node, context);
+			top--;
+		}
+
+		if (!next) continue;
+
+		if (top == capacity) {
+			traverse_frame *grown =
+			    malloc(2 * capacity * sizeof(traverse_frame));
+			if (!grown) {
+				if (stack != local) free(stack);
+				return -1;
+			}
+			memcpy(grown, stack, capacity * sizeof(traverse_frame));
+			if (stack != local) free(stack);
+			stack = grown;
+			capacity *= 2;
+		}
+
+		stack[top++] = (traverse_frame){.node = next};
 	}
-	if (current->left_branch) {
-		traverse_all(current->left_branch, v, context);
+
+	if (stack != local) free(stack);
+	return 0;
+}
+
+static void tree_order_pre(tree_node *current, void *vctx) {
+	tree_order *order = vctx;
+	ORDER_BEGIN(*order, current) = order->size;
+}
+
+static void tree_order_process(tree_node *current, void *vctx) {
+	tree_order *order = vctx;
+	if (!current->left_branch) {
+		order->leaves[order->size++] = current->index;
 	}
-	if (v->process) {
-		v->process(current, context);
+}
+
+static void tree_order_post(tree_node *current, void *vctx) {
+	tree_order *order = vctx;
+	ORDER_END(*order, current) = order->size;
+}
+
+/** @brief Compute the depth-first order of the leaves and the range of every
+ * clade within it. The subtrees of the root are visited left, right, extra.
+ *
+ * @param order - The order to fill. Free with tree_order_free().
+ * @param baum - The tree.
+ * @returns 0 on success, or -1 on error.
+ */
+int tree_order_init(tree_order *order, const tree_s *baum) {
+	if (!order || !baum || !baum->size) return -1;
+	size_t size = baum->size;
+
+	*order = (tree_order){.pool = baum->pool};
+	order->leaves = malloc(2 * size * sizeof(size_t));
+	order->begin = malloc(2 * size * sizeof(size_t));
+	order->end = malloc(2 * size * sizeof(size_t));
+
+	visitor_ctx v = {.pre = tree_order_pre,
+	                 .process = tree_order_process,
+	                 .post = tree_order_post};
+
+	const tree_root *root = &baum->root;
+	if (!order->leaves || !order->begin || !order->end ||
+	    traverse_all(root->left_branch, &v, order) != 0 ||
+	    traverse_all(root->right_branch, &v, order) != 0 ||
+	    traverse_all(root->extra_branch, &v, order) != 0) {
+		tree_order_free(order);
+		return -1;
 	}
-	if (current->right_branch) {
-		traverse_all(current->right_branch, v, context);
+
+	assert(order->size == size);
+	memcpy(order->leaves + size, order->leaves, size * sizeof(size_t));
+
+	return 0;
+}
+
+void tree_order_free(tree_order *order) {
+	if (!order) return;
+	free(order->leaves);
+	free(order->begin);
+	free(order->end);
+	*order = (tree_order){};
+}
+
+static void tree_clades_post(tree_node *current, void *vctx) {
+	tree_clades *clades = vctx;
+	uint64_t *clade = CLADE(*clades, current);
+
+	if (!current->left_branch) {
+		clade[current->index / 64] |= UINT64_C(1) << (current->index % 64);
+		return;
 	}
-	if (v->post) {
-		v->post(current, context);
+
+	const uint64_t *left = CLADE(*clades, current->left_branch);
+	const uint64_t *right = CLADE(*clades, current->right_branch);
+	for (size_t w = 0; w < clades->words; w++) {
+		clade[w] = left[w] | right[w];
 	}
 }
 
+/** @brief Compute the clades of all nodes in a single post-order pass. The
+ * root itself is not part of the pool and has no clade; the clades of its
+ * three subtrees together cover all leaves.
+ *
+ * @param clades - The clades to fill. Free with tree_clades_free().
+ * @param baum - The tree.
+ * @returns 0 on success, or -1 on error.
+ */
+int tree_clades_init(tree_clades *clades, const tree_s *baum) {
+	if (!clades || !baum || !baum->size) return -1;
+	size_t size = baum->size;
+
+	*clades = (tree_clades){
+	    .size = size, .words = (size + 63) / 64, .pool = baum->pool};
+	clades->bits = calloc(2 * size * clades->words, sizeof(uint64_t));
+
+	visitor_ctx v = {.pre = NULL, .process = NULL, .post = tree_clades_post};
+
+	const tree_root *root = &baum->root;
+	if (!clades->bits || traverse_all(root->left_branch, &v, clades) != 0 ||
+	    traverse_all(root->right_branch, &v, clades) != 0 ||
+	    traverse_all(root->extra_branch, &v, clades) != 0) {
+		tree_clades_free(clades);
+		return -1;
+	}
+
+	return 0;
+}
+
+void tree_clades_free(tree_clades *clades) {
+	if (!clades) return;
+	free(clades->bits);
+	*clades = (tree_clades){};
+}
+
+typedef struct newick_ctx {
+	buffer *out;
+	char **names;
+	int intervals;
+} newick_ctx;
+
 void newick_sv_pre(tree_node *current, void *ctx) {
 	if (current->left_branch) {
-		printf("(");
+		buffer_putc(((newick_ctx *)ctx)->out, '(');
 	}
 }
 
+/** @brief Convert a support value to whole percent, rounding down. Values
+ * outside of [0, 1], including NaN, are clamped instead of being converted to
+ * int unchecked. */
+static int support_percent(double support) {
+	double percent = support * 100;
+	if (!(percent > 0)) return 0;
+	if (percent >= 100) return 100;
+	return (int)percent;
+}
+
+/** @brief Print the support label of a branch. When the support values are
+ * estimated from samples, the confidence interval is appended as a Newick
+ * comment.
+ */
+static void newick_sv_support(const newick_ctx *ctx, double support,
+                              double lower, double upper) {
+	buffer *out = ctx->out;
+	buffer_size(out, support_percent(support));
+	if (ctx->intervals) {
+		buffer_putc(out, '[');
+		buffer_size(out, support_percent(lower));
+		buffer_putc(out, '-');
+		buffer_size(out, support_percent(upper));
+		buffer_putc(out, ']');
+	}
+}
+
+/** @brief Print the length of a branch, followed by `end`. */
+static void newick_sv_length(buffer *out, double length, char end) {
+	buffer_putc(out, ':');
+	buffer_fixed(out, length, 6);
+	buffer_putc(out, end);
+}
+
 void newick_sv_process(tree_node *current, void *ctx) {
+	buffer *out = ((newick_ctx *)ctx)->out;
+
 	if (current->left_branch) {
 		if (current->left_branch->left_branch) {
-			printf("%d:%lf,", (int)(current->left_support * 100),
-			       current->left_dist);
-		} else {
-			printf(":%lf,", current->left_dist);
+			newick_sv_support(ctx, current->left_support, current->left_lower,
+			                  current->left_upper);
 		}
+		newick_sv_length(out, current->left_dist, ',');
 	} else {
-		printf("%s", ((char **)ctx)[current->index]);
+		buffer_puts(out, ((newick_ctx *)ctx)->names[current->index]);
 	}
 }
 
 void newick_sv_post(tree_node *current, void *ctx) {
 	if (!current->right_branch) return;
+	buffer *out = ((newick_ctx *)ctx)->out;
+
 	if (current->right_branch->right_branch) {
-		printf("%d:%lf)", (int)(current->right_support * 100),
-		       current->right_dist);
-	} else {
-		printf(":%lf)", current->right_dist);
+		newick_sv_support(ctx, current->right_support, current->right_lower,
+		                  current->right_upper);
 	}
+	newick_sv_length(out, current->right_dist, ')');
 }
 
-void newick_sv(tree_root *root, char **names) {
+/** @brief Append a tree with its support values in Newick format to a
+ * buffer.
+ *
+ * @param actx - The context of the analysis.
+ * @param out - The buffer.
+ * @param root - The root of the tree.
+ * @param names - The names of the taxa.
+ * @returns 0 on success, or -1 if out of memory.
+ */
+int newick_sv_buffer(const afra_ctx *actx, buffer *out, tree_root *root,
+                     char **names) {
+	newick_ctx ctx = {
+	    .out = out, .names = names, .intervals = actx->samples != 0};
 	visitor_ctx v = {.pre = newick_sv_pre,
 	                 .process = newick_sv_process,
 	                 .post = newick_sv_post};
 
-	printf("(");
-	traverse_all(root->left_branch, &v, names);
-	newick_sv_process(&root->as_tree_node, names);
+	buffer_putc(out, '(');
+	int check = traverse_all(root->left_branch, &v, &ctx);
+	newick_sv_process(&root->as_tree_node, &ctx);
 
-	traverse_all(root->right_branch, &v, names);
+	check |= traverse_all(root->right_branch, &v, &ctx);
 	if (root->right_branch && root->right_branch->right_branch) {
-		printf("%d:%lf,", (int)(root->right_support * 100), root->right_dist);
-	} else {
-		printf(":%lf,", root->right_dist);
+		newick_sv_support(&ctx, root->right_support, root->right_lower,
+		                  root->right_upper);
 	}
+	newick_sv_length(out, root->right_dist, ',');
 
-	traverse_all(root->extra_branch, &v, names);
+	check |= traverse_all(root->extra_branch, &v, &ctx);
 	if (root->extra_branch && root->extra_branch->left_branch) {
-		printf("%d:%lf)", (int)(root->extra_support * 100), root->extra_dist);
+		newick_sv_support(&ctx, root->extra_support, root->extra_lower,
+		                  root->extra_upper);
+	}
+	newick_sv_length(out, root->extra_dist, ')');
+	buffer_puts(out, ";\n");
+
+	return check || out->failed ? -1 : 0;
+}
+
+/** @brief Print a tree with its support values in Newick format. The tree is
+ * formatted into a buffer first and written with a single call.
+ *
+ * @param actx - The context of the analysis.
+ * @param out - The stream to write to.
+ * @param root - The root of the tree.
+ * @param names - The names of the taxa.
+ * @returns 0 on success, or -1 if out of memory.
+ */
+int newick_sv(const afra_ctx *actx, FILE *out, tree_root *root,
+              char **names) {
+	buffer buf = {};
+	int check = newick_sv_buffer(actx, &buf, root, names);
+	if (!check) check = buffer_flush(&buf, out);
+	buffer_free(&buf);
+	return check;
+}
+
+/* Reading trees in Newick format. A tree is first parsed into a list of nodes,
+ * as neither its size nor its shape is known in advance. Then it is checked
+ * against the taxa of the matrix and copied into a tree_s. */
+
+#define NEWICK_NONE SIZE_MAX
+
+typedef struct newick_node {
+	size_t parent, first_child, last_child, next_sibling;
+	size_t children;
+	double length;
+	ssize_t taxon;
+} newick_node;
+
+typedef struct newick_taxon {
+	const char *name;
+	size_t index;
+} newick_taxon;
+
+typedef struct newick_parser {
+	afra_ctx *ctx;
+	FILE *in;
+	newick_node *nodes;
+	size_t count, capacity;
+	newick_taxon *taxa;
+	size_t size;
+	char *seen;
+	buffer label;
+} newick_parser;
+
+static int newick_taxon_compare(const void *a, const void *b) {
+	return strcmp(((const newick_taxon *)a)->name,
+	              ((const newick_taxon *)b)->name);
+}
+
+static size_t newick_node_new(newick_parser *p, size_t parent) {
+	if (p->count == p->capacity) {
+		size_t capacity = p->capacity ? 2 * p->capacity : 64;
+		newick_node *nodes = realloc(p->nodes, capacity * sizeof(newick_node));
+		if (!nodes) return NEWICK_NONE;
+		p->nodes = nodes;
+		p->capacity = capacity;
+	}
+
+	size_t id = p->count++;
+	p->nodes[id] = (newick_node){.parent = parent,
+	                             .first_child = NEWICK_NONE,
+	                             .last_child = NEWICK_NONE,
+	                             .next_sibling = NEWICK_NONE,
+	                             .taxon = -1};
+
+	if (parent != NEWICK_NONE) {
+		newick_node *up = &p->nodes[parent];
+		if (up->last_child == NEWICK_NONE) {
+			up->first_child = id;
+		} else {
+			p->nodes[up->last_child].next_sibling = id;
+		}
+		up->last_child = id;
+		up->children++;
+	}
+
+	return id;
+}
+
+/** @brief Read the next character that is neither white space nor part of a
+ * comment. */
+static int newick_next(FILE *in) {
+	int c;
+	while ((c = getc(in)) != EOF) {
+		if (c == '[') {
+			while ((c = getc(in)) != EOF && c != ']') {
+			}
+			if (c == EOF) return EOF;
+			continue;
+		}
+		if (!isspace(c)) return c;
+	}
+	return EOF;
+}
+
+static int newick_delimiter(int c) {
+	return c == EOF || c == '(' || c == ')' || c == ',' || c == ':' ||
+	       c == ';' || c == '[' || isspace(c);
+}
+
+/** @brief Read a label starting with `c` into the label buffer. Labels are
+ * either unquoted or enclosed in single quotes, with '' for a quote. */
+static int newick_label(newick_parser *p, int c) {
+	buffer *label = &p->label;
+	label->length = 0;
+
+	if (c == '\'') {
+		while (1) {
+			c = getc(p->in);
+			if (c == EOF) {
+				return afra_fail(p->ctx, AFRA_ERROR_FORMAT,
+				                 "unterminated quoted label");
+			}
+			if (c == '\'') {
+				c = getc(p->in);
+				if (c != '\'') break;
+			}
+			buffer_putc(label, c);
+		}
 	} else {
-		printf(":%lf)", root->extra_dist);
+		while (!newick_delimiter(c)) {
+			buffer_putc(label, c);
+			c = getc(p->in);
+		}
+	}
+
+	if (c != EOF) ungetc(c, p->in);
+	buffer_putc(label, '\0');
+
+	if (label->failed) {
+		return afra_fail(p->ctx, AFRA_ERROR_MEMORY, "Out of memory");
+	}
+	return 0;
+}
+
+static int newick_leaf(newick_parser *p, size_t id) {
+	newick_taxon needle = {.name = p->label.data};
+	newick_taxon *found = bsearch(&needle, p->taxa, p->size,
+	                              sizeof(newick_taxon), newick_taxon_compare);
+	if (!found) {
+		return afra_fail(p->ctx, AFRA_ERROR_FORMAT,
+		                 "taxon '%s' is not in the matrix", p->label.data);
+	}
+	if (p->seen[found->index]) {
+		return afra_fail(p->ctx, AFRA_ERROR_FORMAT,
+		                 "taxon '%s' occurs more than once", p->label.data);
+	}
+
+	p->seen[found->index] = 1;
+	p->nodes[id].taxon = found->index;
+	return 0;
+}
+
+static int newick_unexpected(newick_parser *p, int c) {
+	if (c == EOF) {
+		return afra_fail(p->ctx, AFRA_ERROR_FORMAT,
+		                 "unexpected end of input");
+	}
+	return afra_fail(p->ctx, AFRA_ERROR_FORMAT, "unexpected '%c'", c);
+}
+
+/** @brief Parse one tree, up to and including the closing semicolon.
+ *
+ * @returns 0 on success, 1 if the input holds no further tree, or -1 on
+ * error.
+ */
+static int newick_parse(newick_parser *p) {
+	int c = newick_next(p->in);
+	if (c == EOF) return 1;
+
+	size_t current = newick_node_new(p, NEWICK_NONE);
+	int subtree = 1;
+
+	while (current != NEWICK_NONE) {
+		if (subtree) {
+			// a subtree starts with a parenthesis or is a single taxon
+			if (c == '(') {
+				current = newick_node_new(p, current);
+				c = newick_next(p->in);
+				continue;
+			}
+			if (newick_delimiter(c)) {
+				return newick_unexpected(p, c);
+			}
+			if (newick_label(p, c) || newick_leaf(p, current)) return -1;
+
+			subtree = 0;
+			c = newick_next(p->in);
+			continue;
+		}
+
+		// the label of an inner node, such as a support value, is ignored
+		if (!newick_delimiter(c)) {
+			if (p->nodes[current].taxon >= 0) return newick_unexpected(p, c);
+			if (newick_label(p, c)) return -1;
+			c = newick_next(p->in);
+		}
+
+		if (c == ':') {
+			c = newick_next(p->in);
+			if (newick_delimiter(c) || newick_label(p, c)) {
+				return newick_unexpected(p, c);
+			}
+
+			char *end;
+			double length = strtod(p->label.data, &end);
+			if (end == p->label.data || *end) {
+				return afra_fail(p->ctx, AFRA_ERROR_FORMAT,
+				                 "invalid branch length '%s'", p->label.data);
+			}
+			p->nodes[current].length = length;
+			c = newick_next(p->in);
+		}
+
+		size_t parent = p->nodes[current].parent;
+		if (c == ',' && parent != NEWICK_NONE) {
+			current = newick_node_new(p, parent);
+			subtree = 1;
+		} else if (c == ')' && parent != NEWICK_NONE) {
+			current = parent;
+		} else if (c == ';' && parent == NEWICK_NONE) {
+			return 0;
+		} else {
+			return newick_unexpected(p, c);
+		}
+		c = newick_next(p->in);
+	}
+
+	return afra_fail(p->ctx, AFRA_ERROR_MEMORY, "Out of memory");
+}
+
+/** @brief Copy a parsed tree into `tree`. A root with two children is
+ * removed, as the trees of afra are unrooted.
+ */
+/** @brief Skip a chain of single child nodes, as in `((A))`.
+ *
+ * @param nodes - The parsed nodes.
+ * @param id - The first node of the chain.
+ * @param length - Out parameter for the length of the whole chain.
+ * @returns the node at the end of the chain.
+ */
+static size_t newick_skip(const newick_node *nodes, size_t id,
+                          double *length) {
+	*length = nodes[id].length;
+	while (nodes[id].taxon < 0 && nodes[id].children == 1) {
+		id = nodes[id].first_child;
+		*length += nodes[id].length;
+	}
+	return id;
+}
+
+static int newick_build(newick_parser *p, tree_s *tree) {
+	newick_node *nodes = p->nodes;
+	const ssize_t removed = -2;
+
+	for (size_t i = 0; i < p->size; i++) {
+		if (!p->seen[p->taxa[i].index]) {
+			return afra_fail(p->ctx, AFRA_ERROR_FORMAT,
+			                 "taxon '%s' is missing", p->taxa[i].name);
+		}
+	}
+
+	double unused;
+	size_t root = newick_skip(nodes, 0, &unused);
+	nodes[root].taxon = removed;
+
+	// the three subtrees at the root
+	size_t top[3] = {NEWICK_NONE, NEWICK_NONE, NEWICK_NONE};
+	double top_length[3] = {0};
+
+	if (nodes[root].children == 2) {
+		double x_length, y_length;
+		size_t x = newick_skip(nodes, nodes[root].first_child, &x_length);
+		size_t y = newick_skip(
+		    nodes, nodes[nodes[root].first_child].next_sibling, &y_length);
+		if (nodes[x].children == 0) {
+			size_t temp = x;
+			x = y;
+			y = temp;
+			double temp_length = x_length;
+			x_length = y_length;
+			y_length = temp_length;
+		}
+		if (nodes[x].children == 2) {
+			nodes[x].taxon = removed;
+			size_t first = nodes[x].first_child;
+			top[0] = newick_skip(nodes, first, &top_length[0]);
+			top[1] = newick_skip(nodes, nodes[first].next_sibling,
+			                     &top_length[1]);
+			top[2] = y;
+			top_length[2] = y_length + x_length;
+		}
+	} else if (nodes[root].children == 3) {
+		size_t k = 0;
+		for (size_t id = nodes[root].first_child; id != NEWICK_NONE;
+		     id = nodes[id].next_sibling) {
+			top[k] = newick_skip(nodes, id, &top_length[k]);
+			k++;
+		}
+	}
+
+	// single child nodes get no place in the tree
+	for (size_t id = 0; id < p->count; id++) {
+		if (nodes[id].taxon == -1 && nodes[id].children == 1) {
+			nodes[id].taxon = removed;
+		}
+	}
+
+	int binary = top[0] != NEWICK_NONE;
+	for (size_t id = 0; id < p->count && binary; id++) {
+		if (nodes[id].taxon == -1 && nodes[id].children != 2) binary = 0;
+	}
+	if (!binary) {
+		return afra_fail(p->ctx, AFRA_ERROR_FORMAT, "the tree is not binary");
+	}
+
+	if (tree_init(tree, p->size) != 0) {
+		return afra_fail(p->ctx, AFRA_ERROR_MEMORY, "Out of memory");
 	}
-	printf(";\n");
+
+	// reuse the parent field for the position of a node in the pool
+	size_t inner = p->size;
+	for (size_t id = 0; id < p->count; id++) {
+		if (nodes[id].taxon >= 0) {
+			nodes[id].parent = nodes[id].taxon;
+		} else if (nodes[id].taxon == -1) {
+			nodes[id].parent = inner++;
+		}
+	}
+
+	for (size_t i = 0; i < p->size; i++) {
+		tree->pool[i] = LEAF(i);
+	}
+
+	for (size_t id = 0; id < p->count; id++) {
+		if (nodes[id].taxon != -1) continue;
+
+		double left_length, right_length;
+		size_t first = nodes[id].first_child;
+		const newick_node *left =
+		    &nodes[newick_skip(nodes, first, &left_length)];
+		const newick_node *right = &nodes[newick_skip(
+		    nodes, nodes[first].next_sibling, &right_length)];
+		tree->pool[nodes[id].parent] =
+		    BRANCH(.left_branch = &tree->pool[left->parent],
+		           .right_branch = &tree->pool[right->parent],
+		           .left_dist = left_length, .right_dist = right_length,
+		           .index = -1);
+	}
+
+	tree->root.left_branch = &tree->pool[nodes[top[0]].parent];
+	tree->root.right_branch = &tree->pool[nodes[top[1]].parent];
+	tree->root.extra_branch = &tree->pool[nodes[top[2]].parent];
+	tree->root.left_dist = top_length[0];
+	tree->root.right_dist = top_length[1];
+	tree->root.extra_dist = top_length[2];
+
+	return 0;
+}
+
+/** @brief Read a tree in Newick format.
+ *
+ * The leaves are matched to the taxa of the matrix by name; every taxon has
+ * to occur exactly once. The tree has to be binary, with either two or three
+ * subtrees at the root. Labels of inner nodes are ignored; missing branch
+ * lengths are zero.
+ *
+ * @param ctx - The context; errors are recorded here.
+ * @param in - The stream to read from. Several trees may follow each other.
+ * @param distance - The matrix whose taxa the tree relates.
+ * @param tree - Out parameter for the tree. Free with tree_free().
+ * @returns 0 on success, 1 if there are no more trees, or -1 on error.
+ */
+int newick_read(afra_ctx *ctx, FILE *in, const matrix *distance,
+                tree_s *tree) {
+	size_t size = distance->size;
+	newick_parser p = {.ctx = ctx, .in = in, .size = size};
+	p.taxa = malloc(size * sizeof(newick_taxon));
+	p.seen = calloc(size, 1);
+
+	int check = 0;
+	if (!p.taxa || !p.seen) {
+		check = afra_fail(ctx, AFRA_ERROR_MEMORY, "Out of memory");
+	}
+
+	for (size_t i = 0; i < size && !check; i++) {
+		p.taxa[i] = (newick_taxon){.name = distance->names[i], .index = i};
+	}
+	if (!check) {
+		qsort(p.taxa, size, sizeof(newick_taxon), newick_taxon_compare);
+	}
+	for (size_t i = 1; i < size && !check; i++) {
+		if (strcmp(p.taxa[i - 1].name, p.taxa[i].name) == 0) {
+			check = afra_fail(ctx, AFRA_ERROR_FORMAT,
+			                  "taxon '%s' occurs more than once in the matrix",
+			                  p.taxa[i].name);
+		}
+	}
+
+	if (!check) check = newick_parse(&p);
+	if (!check) check = newick_build(&p, tree);
+
+	free(p.nodes);
+	free(p.taxa);
+	free(p.seen);
+	buffer_free(&p.label);
+	return check;
 }
@@ -17,14 +17,19 @@
 #ifndef GRAPH_H
 #define GRAPH_H
 
+#include <stdint.h>
 #include <stdio.h>
 
+#include "buffer.h"
+#include "global.h"
 #include "matrix.h"
 
 typedef struct tree_node {
 	struct tree_node *left_branch, *right_branch;
 	double left_dist, right_dist;
 	double left_support, right_support;
+	double left_lower, right_lower;
+	double left_upper, right_upper;
 	ssize_t index;
 } tree_node;
 
@@ -36,6 +41,7 @@ typedef struct tree_root {
 	tree_node *extra_branch;
 	double extra_dist;
 	double extra_support;
+	double extra_lower, extra_upper;
 } tree_root;
 
 #define LEAF(I) ((struct tree_node){.index = (I)})
@@ -50,14 +56,52 @@ typedef struct tree_s {
 int tree_init(tree_s *baum, size_t size);
 void tree_free(tree_s *baum);
 
-int neighbor_joining(matrix *distance, tree_s *out_tree);
+int neighbor_joining(afra_ctx *, const matrix *distance, tree_s *out_tree);
+int neighbor_joining_rapid(afra_ctx *, const matrix *distance,
+                           tree_s *out_tree);
 
 typedef void (*tree_node_processor_context)(tree_node *, void *);
 typedef struct visitor_ctx {
 	tree_node_processor_context pre, process, post;
 } visitor_ctx;
-void traverse_all(tree_node *current, visitor_ctx *v, void *);
+int traverse_all(tree_node *current, visitor_ctx *v, void *);
 
-void newick_sv(tree_root *, char **);
+/** The leaves of a tree in depth-first order. Every clade is a contiguous
+ * range of this order. The order is stored twice in a row, so that the
+ * complement of a clade is contiguous, too. */
+typedef struct tree_order {
+	size_t size;
+	size_t *leaves;
+	size_t *begin, *end;
+	const tree_node *pool;
+} tree_order;
+
+int tree_order_init(tree_order *, const tree_s *);
+void tree_order_free(tree_order *);
+
+#define ORDER_BEGIN(ORDER, NODE) ((ORDER).begin[(NODE) - (ORDER).pool])
+#define ORDER_END(ORDER, NODE) ((ORDER).end[(NODE) - (ORDER).pool])
+
+/** The clade of every node as a bitset: bit i is set iff the leaf with index i
+ * is below the node. Each bitset takes `words` words. */
+typedef struct tree_clades {
+	size_t size, words;
+	uint64_t *bits;
+	const tree_node *pool;
+} tree_clades;
+
+int tree_clades_init(tree_clades *, const tree_s *);
+void tree_clades_free(tree_clades *);
+
+#define CLADE(CLADES, NODE)                                                    \
+	((CLADES).bits + ((NODE) - (CLADES).pool) * (CLADES).words)
+
+static inline int clade_has(const uint64_t *clade, size_t i) {
+	return (clade[i / 64] >> (i % 64)) & 1;
+}
+
+int newick_sv(const afra_ctx *, FILE *, tree_root *, char **);
+int newick_sv_buffer(const afra_ctx *, buffer *, tree_root *, char **);
+int newick_read(afra_ctx *, FILE *, const matrix *, tree_s *);
 
 #endif
@@ -14,36 +14,670 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include <err.h>
+#define _POSIX_C_SOURCE 200809L
+
 #include <errno.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "global.h"
+#include "io.h"
 #include "matrix.h"
 
-matrix read_matrix(FILE *in) {
-	size_t matrix_size;
+/* The binary matrix format. All fields are stored in the byte order of the
+ * machine that wrote the file.
+ *
+ *   header      see struct binary_header
+ *   names       all names, each terminated by a NUL byte
+ *   padding     up to the next multiple of BINARY_ALIGN
+ *   data        the cells as laid out in memory, see matrix_offset()
+ */
+
+#define BINARY_MAGIC "\x89" "AFRAMAT"
+#define BINARY_VERSION 1
+#define BINARY_ALIGN 64
 
-	int check = fscanf(in, "%zu\n", &matrix_size);
-	if (check < 1) goto format_error;
+typedef struct binary_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint64_t size;
+	uint64_t flags;
+	uint64_t names_offset, names_bytes;
+	uint64_t data_offset, data_bytes;
+} binary_header;
 
-	matrix distance;
-	int l = matrix_init(&distance, matrix_size);
-	if (l != 0) goto format_error;
+static const uint32_t byte_order_mark = 0x01020304;
 
-	size_t i, j;
-	for (i = 0; i < matrix_size; i++) {
-		check = fscanf(in, "%ms ", &distance.names[i]);
-		if (check < 1) goto format_error;
-		for (j = 0; j < matrix_size; j++) {
-			check = fscanf(in, "%lf ", &MATRIX_CELL(distance, i, j));
-			if (check < 1) goto format_error;
+static int check_header(afra_ctx *ctx, const binary_header *header) {
+	if (memcmp(header->magic, BINARY_MAGIC, sizeof(header->magic)) != 0) {
+		return afra_fail(ctx, AFRA_ERROR_FORMAT,
+		                 "format error: not a binary afra matrix");
+	}
+	if (header->byte_order != byte_order_mark) {
+		return afra_fail(ctx, AFRA_ERROR_FORMAT,
+		                 "format error: binary matrix has a different byte "
+		                 "order");
+	}
+	if (header->version != BINARY_VERSION) {
+		return afra_fail(ctx, AFRA_ERROR_FORMAT,
+		                 "format error: unsupported binary matrix version %u",
+		                 (unsigned)header->version);
+	}
+	if (header->flags & ~(uint64_t)(MATRIX_PACKED | MATRIX_FLOAT) ||
+	    !header->size ||
+	    header->size > SIZE_MAX / header->size /
+	                       (header->flags & MATRIX_FLOAT ? sizeof(float)
+	                                                     : sizeof(double)) ||
+	    header->data_bytes != matrix_bytes(header->size, header->flags) ||
+	    header->names_offset < sizeof(binary_header) ||
+	    header->names_bytes > UINT64_MAX - header->names_offset ||
+	    header->data_offset < header->names_offset + header->names_bytes ||
+	    header->data_bytes > UINT64_MAX - header->data_offset) {
+		return afra_fail(ctx, AFRA_ERROR_FORMAT,
+		                 "format error: corrupt binary matrix header");
+	}
+	return 0;
+}
+
+/** @brief Split the names block into one pointer per taxon. */
+static int parse_names(afra_ctx *ctx, matrix *mx, char *names, size_t bytes) {
+	char *ptr = names, *end = names + bytes;
+	for (size_t i = 0; i < mx->size; i++) {
+		char *nul = memchr(ptr, '\0', end - ptr);
+		if (!nul) {
+			return afra_fail(ctx, AFRA_ERROR_FORMAT,
+			                 "format error: corrupt names in binary matrix");
 		}
+		mx->names[i] = ptr;
+		ptr = nul + 1;
+	}
+	return 0;
+}
+
+static int truncated(afra_ctx *ctx) {
+	return afra_fail(ctx, AFRA_ERROR_FORMAT,
+	                 "format error: truncated binary matrix");
+}
+
+/** @brief Map a binary matrix into memory. The data is used in place; only
+ * the array of name pointers is allocated.
+ *
+ * @returns 0 on success, 1 if the file cannot be mapped, or -1 on error.
+ */
+static int map_binary_matrix(afra_ctx *ctx, FILE *in, matrix *mx) {
+	int fd = fileno(in);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+	    ftello(in) != 0) {
+		return 1;
+	}
+
+	size_t length = st.st_size;
+	if (length < sizeof(binary_header)) return truncated(ctx);
+
+	char *mapping = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (mapping == MAP_FAILED) return 1;
+
+	binary_header header;
+	memcpy(&header, mapping, sizeof(header));
+	int check = check_header(ctx, &header);
+
+	// the offsets are checked first, so the differences cannot wrap
+	if (!check && (header.names_offset > length ||
+	               header.names_bytes > length - header.names_offset ||
+	               header.data_offset > length ||
+	               header.data_bytes > length - header.data_offset)) {
+		check = truncated(ctx);
+	}
+
+	char **names = check ? NULL : malloc(header.size * sizeof(char *));
+	if (!check && !names) {
+		check = afra_fail(ctx, AFRA_ERROR_MEMORY, "Out of memory");
+	}
+	if (check) {
+		munmap(mapping, length);
+		return -1;
+	}
+
+	*mx = (matrix){.size = header.size,
+	               .flags = header.flags,
+	               .data = mapping + header.data_offset,
+	               .names = names,
+	               .mapping = mapping,
+	               .mapping_size = length};
+
+	if (parse_names(ctx, mx, mapping + header.names_offset,
+	                header.names_bytes) != 0) {
+		matrix_free(mx);
+		return -1;
+	}
+
+	// Leave the stream behind the matrix, where the next one may start.
+	fseeko(in, header.data_offset + header.data_bytes, SEEK_SET);
+
+	return 0;
+}
+
+static int read_fully(afra_ctx *ctx, FILE *in, void *ptr, size_t bytes) {
+	if (bytes && fread(ptr, bytes, 1, in) != 1) {
+		return truncated(ctx);
+	}
+	return 0;
+}
+
+static int skip_bytes(afra_ctx *ctx, FILE *in, size_t bytes) {
+	char buffer[BINARY_ALIGN];
+	while (bytes) {
+		size_t chunk = bytes < sizeof(buffer) ? bytes : sizeof(buffer);
+		if (read_fully(ctx, in, buffer, chunk) != 0) return -1;
+		bytes -= chunk;
+	}
+	return 0;
+}
+
+/** @brief Read a binary matrix from a stream that cannot be mapped, such as
+ * a pipe.
+ */
+static int read_binary_stream(afra_ctx *ctx, FILE *in, matrix *mx) {
+	binary_header header;
+	if (read_fully(ctx, in, &header, sizeof(header)) != 0 ||
+	    check_header(ctx, &header) != 0 ||
+	    skip_bytes(ctx, in, header.names_offset - sizeof(header)) != 0) {
+		return -1;
+	}
+
+	char *names = malloc(header.names_bytes + 1);
+	if (!names) return afra_fail(ctx, AFRA_ERROR_MEMORY, "Out of memory");
+
+	if (matrix_init(mx, header.size, header.flags) != 0) {
+		free(names);
+		return afra_fail(ctx, AFRA_ERROR_MEMORY, "binary matrix too large.");
+	}
+
+	int check = read_fully(ctx, in, names, header.names_bytes) ||
+	            skip_bytes(ctx, in,
+	                       header.data_offset - header.names_offset -
+	                           header.names_bytes) ||
+	            read_fully(ctx, in, mx->data, header.data_bytes) ||
+	            parse_names(ctx, mx, names, header.names_bytes);
+
+	if (check) {
+		free(names);
+		matrix_free(mx);
+		return -1;
+	}
+
+	// the names stay in the block they were read into
+	mx->name_data = names;
+	return 0;
+}
+
+/** @brief Read a matrix in the binary format. Regular files are mapped into
+ * memory and used in place.
+ */
+static int read_binary_matrix(afra_ctx *ctx, FILE *in, matrix *mx) {
+	int check = map_binary_matrix(ctx, in, mx);
+	if (check <= 0) return check;
+	return read_binary_stream(ctx, in, mx);
+}
+
+/** @brief Write a matrix in the binary format.
+ *
+ * @param out - The stream to write to.
+ * @param mx - The matrix.
+ * @returns 0 on success.
+ */
+int write_binary_matrix(FILE *out, const matrix *mx) {
+	size_t names_bytes = 0;
+	for (size_t i = 0; i < mx->size; i++) {
+		names_bytes += strlen(mx->names[i]) + 1;
+	}
+
+	size_t data_offset = sizeof(binary_header) + names_bytes;
+	size_t padding = (BINARY_ALIGN - data_offset % BINARY_ALIGN) % BINARY_ALIGN;
+	data_offset += padding;
+
+	binary_header header = {.version = BINARY_VERSION,
+	                        .byte_order = byte_order_mark,
+	                        .size = mx->size,
+	                        .flags = mx->flags,
+	                        .names_offset = sizeof(binary_header),
+	                        .names_bytes = names_bytes,
+	                        .data_offset = data_offset,
+	                        .data_bytes = matrix_bytes(mx->size, mx->flags)};
+	memcpy(header.magic, BINARY_MAGIC, sizeof(header.magic));
+
+	static const char zeros[BINARY_ALIGN] = {0};
+	int check = fwrite(&header, sizeof(header), 1, out) != 1;
+	for (size_t i = 0; i < mx->size; i++) {
+		check |= fputs(mx->names[i], out) == EOF;
+		check |= fputc('\0', out) == EOF;
+	}
+	check |= fwrite(zeros, 1, padding, out) != padding;
+	check |= fwrite(mx->data, header.data_bytes, 1, out) != 1;
+
+	return check ? -1 : 0;
+}
+
+/* The PHYLIP reader works in two steps. First, the rows are read line by line
+ * into one buffer, counting tokens to find where each row ends; rows may be
+ * wrapped over several lines. Then the rows are parsed in parallel. */
+
+typedef struct phylip_row {
+	size_t begin, end;
+	size_t line;
+} phylip_row;
+
+typedef struct phylip_text {
+	char *data;
+	size_t length, capacity;
+} phylip_text;
+
+static int text_append(scratch_pool *pool, phylip_text *text, const char *str,
+                       size_t length) {
+	if (text->length + length + 1 > text->capacity) {
+		size_t capacity = text->capacity ? text->capacity : 1 << 16;
+		while (text->length + length + 1 > capacity) {
+			capacity *= 2;
+		}
+		char *data = text->data ? scratch_resize(pool, text->data, capacity)
+		                        : scratch_get(pool, capacity);
+		if (!data) return -1;
+		text->data = data;
+		text->capacity = capacity;
+	}
+	memcpy(text->data + text->length, str, length);
+	text->length += length;
+	text->data[text->length] = '\0';
+	return 0;
+}
+
+static int is_space(char c) {
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' ||
+	       c == '\f';
+}
+
+static size_t count_tokens(const char *str, size_t length) {
+	size_t tokens = 0;
+	int in_token = 0;
+	for (size_t i = 0; i < length; i++) {
+		int space = is_space(str[i]);
+		tokens += !space && !in_token;
+		in_token = !space;
+	}
+	return tokens;
+}
+
+/** @brief Parse a floating point number. Decimal numbers with at most 19
+ * significant digits and a small exponent are converted exactly with a
+ * single multiplication or division; everything else, like hexadecimal
+ * numbers, infinities or long tokens, is left to strtod(). Either way the
+ * result is correctly rounded, i.e. the same as with scanf.
+ *
+ * @param str - The start of the number.
+ * @param end - The end of the buffer.
+ * @param out - Out parameter for the value.
+ * @returns a pointer past the number, or NULL on error.
+ */
+static const char *parse_double(const char *str, const char *end,
+                                double *out) {
+	static const double powers[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,
+	                                1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+	                                1e12, 1e13, 1e14, 1e15, 1e16, 1e17,
+	                                1e18, 1e19, 1e20, 1e21, 1e22};
+
+	const char *ptr = str;
+	int negative = 0;
+	if (ptr < end && (*ptr == '-' || *ptr == '+')) {
+		negative = *ptr++ == '-';
+	}
+
+	uint64_t mantissa = 0;
+	int digits = 0, exponent = 0, any = 0;
+
+	for (; ptr < end && *ptr >= '0' && *ptr <= '9'; ptr++, any = 1) {
+		if (mantissa || *ptr != '0') digits++;
+		if (digits > 19) goto slow;
+		mantissa = mantissa * 10 + (*ptr - '0');
+	}
+	if (ptr < end && *ptr == '.') {
+		for (ptr++; ptr < end && *ptr >= '0' && *ptr <= '9'; ptr++, any = 1) {
+			if (mantissa || *ptr != '0') digits++;
+			if (digits > 19) goto slow;
+			mantissa = mantissa * 10 + (*ptr - '0');
+			exponent--;
+		}
+	}
+	if (!any) goto slow;
+
+	if (ptr < end && (*ptr == 'e' || *ptr == 'E')) {
+		ptr++;
+		int exp_negative = 0;
+		if (ptr < end && (*ptr == '-' || *ptr == '+')) {
+			exp_negative = *ptr++ == '-';
+		}
+		if (ptr >= end || *ptr < '0' || *ptr > '9') goto slow;
+		int value = 0;
+		for (; ptr < end && *ptr >= '0' && *ptr <= '9'; ptr++) {
+			if (value < 10000) value = value * 10 + (*ptr - '0');
+		}
+		exponent += exp_negative ? -value : value;
+	}
+
+	if (ptr < end && !is_space(*ptr)) goto slow;
+	if (mantissa > (UINT64_C(1) << 53) || exponent < -22 || exponent > 22) {
+		goto slow;
+	}
+
+	double value = (double)mantissa;
+	value = exponent < 0 ? value / powers[-exponent] : value * powers[exponent];
+	*out = negative ? -value : value;
+	return ptr;
+
+slow:;
+	const char *token_end = str;
+	while (token_end < end && !is_space(*token_end)) {
+		token_end++;
+	}
+
+	char small[64];
+	size_t length = token_end - str;
+	char *buffer = length < sizeof(small) ? small : malloc(length + 1);
+	if (!buffer) return NULL;
+	memcpy(buffer, str, length);
+	buffer[length] = '\0';
+
+	char *parsed;
+	errno = 0;
+	*out = strtod(buffer, &parsed);
+	int valid = parsed == buffer + length && length != 0;
+	if (buffer != small) free(buffer);
+	return valid ? token_end : NULL;
+}
+
+/** @brief Report a format error at the given offset of the buffer. */
+static int phylip_error(afra_ctx *ctx, const phylip_text *text,
+                        const phylip_row *row, size_t offset,
+                        const char *what) {
+	size_t line = row->line, column = 1;
+	for (size_t i = row->begin; i < offset; i++) {
+		if (text->data[i] == '\n') {
+			line++;
+			column = 1;
+		} else {
+			column++;
+		}
+	}
+	return afra_fail(ctx, AFRA_ERROR_FORMAT,
+	                 "format error in line %zu, column %zu: %s", line, column,
+	                 what);
+}
+
+/** @brief Parse one row of a PHYLIP matrix.
+ *
+ * @returns 0 on success, or the offset of the first error plus one.
+ */
+static size_t parse_row(matrix *distance, const phylip_text *text,
+                        const phylip_row *row, size_t i, int triangular) {
+	const char *ptr = text->data + row->begin;
+	const char *end = text->data + row->end;
+
+	while (ptr < end && is_space(*ptr)) ptr++;
+	const char *name = ptr;
+	while (ptr < end && !is_space(*ptr)) ptr++;
+
+	distance->names[i] = text->data + (name - text->data);
+
+	// terminate the name in place; it is copied by matrix_names()
+	if (ptr < end) text->data[ptr++ - text->data] = '\0';
+
+	size_t values = triangular ? i : distance->size;
+	int packed = distance->flags & MATRIX_PACKED;
+
+	for (size_t j = 0; j < values; j++) {
+		while (ptr < end && is_space(*ptr)) ptr++;
+
+		double value;
+		const char *next = parse_double(ptr, end, &value);
+		if (!next) return ptr - text->data + 1;
+		ptr = next;
+
+		if (triangular) {
+			matrix_set(distance, i, j, value);
+			if (!packed) matrix_set(distance, j, i, value);
+		} else if (j <= i || !packed) {
+			matrix_set(distance, i, j, value);
+		}
+	}
+
+	if (triangular) {
+		matrix_set(distance, i, i, 0.0);
+	}
+
+	return 0;
+}
+
+/** @brief Find the first tokens of a string.
+ *
+ * @param str - The string.
+ * @param length - The length of the string.
+ * @param wanted - The maximum number of tokens to take.
+ * @param count - Out parameter for the number of tokens taken.
+ * @returns the number of bytes up to and including the space after the last
+ * token taken, or length if the string has no further tokens.
+ */
+static size_t take_tokens(const char *str, size_t length, size_t wanted,
+                          size_t *count) {
+	size_t tokens = 0;
+	int in_token = 0;
+	for (size_t i = 0; i < length; i++) {
+		int space = is_space(str[i]);
+		if (space && in_token && tokens == wanted) {
+			*count = tokens;
+			size_t next = i;
+			while (next < length && is_space(str[next])) next++;
+			return next < length ? i + 1 : length;
+		}
+		tokens += !space && !in_token;
+		in_token = !space;
+	}
+	*count = tokens;
+	return length;
+}
+
+/** @brief Read the rows of a PHYLIP matrix into one buffer and find where
+ * each row begins and ends. Rows are split by their number of values, so a
+ * row may begin in the middle of a line, as with the original scanf parser.
+ *
+ * @returns 0 on success, or -1 on error.
+ */
+static int phylip_split(afra_ctx *ctx, FILE *in, size_t matrix_size,
+                        phylip_text *text, phylip_row *rows, size_t *line_number,
+                        int *triangular) {
+	char *line = NULL;
+	size_t capacity = 0, length = 0, offset = 0;
+	int check = 0;
+
+	for (size_t i = 0; i < matrix_size && !check; i++) {
+		size_t tokens = 0, expected = *triangular ? i + 1 : matrix_size + 1;
+		int pending = offset < length;
+		rows[i] = (phylip_row){.begin = text->length,
+		                       .line = *line_number + !pending};
+
+		while (tokens < expected) {
+			if (offset == length) {
+				ssize_t read = getline(&line, &capacity, in);
+				if (read < 0 && ferror(in)) {
+					check = afra_fail(ctx, AFRA_ERROR_IO, "read error: %s",
+					                  strerror(errno));
+					break;
+				}
+				if (read < 0) {
+					check = afra_fail(
+					    ctx, AFRA_ERROR_FORMAT,
+					    "format error in line %zu: expected %zu more values "
+					    "for taxon %zu",
+					    *line_number + 1, expected - tokens - (tokens == 0),
+					    i + 1);
+					break;
+				}
+				(*line_number)++;
+				length = read;
+				offset = 0;
+			}
+
+			const char *str = line + offset;
+			size_t count, bytes =
+			                  take_tokens(str, length - offset,
+			                              expected - tokens, &count);
+			if (count == 0) {
+				// skip blank lines
+				if (tokens == 0) rows[i].line++;
+				offset = length;
+				continue;
+			}
+
+			/* A first row consisting of just a name is either the start of a
+			 * wrapped square row or a lower-triangular matrix. Which one is
+			 * decided by the next line starting with a number or a name. */
+			if (i == 0 && tokens == 1 && matrix_size > 1) {
+				const char *ptr = str;
+				while (is_space(*ptr)) ptr++;
+				double dummy;
+				if (!parse_double(ptr, line + length, &dummy)) {
+					*triangular = 1;
+					expected = 1;
+					break;
+				}
+			}
+
+			if (text_append(&ctx->scratch, text, str, bytes) != 0) {
+				check = afra_fail(ctx, AFRA_ERROR_MEMORY, "Out of memory");
+				break;
+			}
+			offset += bytes;
+			tokens += count;
+		}
+
+		rows[i].end = text->length;
+	}
+
+	if (!check && offset < length) {
+		check = afra_fail(ctx, AFRA_ERROR_FORMAT,
+		                  "format error in line %zu: too many values for "
+		                  "taxon %zu",
+		                  *line_number, matrix_size);
+	}
+
+	free(line);
+	return check;
+}
+
+/** @brief Read a distance matrix, either in PHYLIP format or in the binary
+ * format written by write_binary_matrix().
+ *
+ * Square as well as lower-triangular PHYLIP matrices are accepted; the latter
+ * are recognized by a first row consisting of only a name. Rows may be wrapped
+ * over several lines, and a square matrix may put several rows on one line.
+ *
+ * @param ctx - The context; errors are recorded here.
+ * @param in - The stream to read from.
+ * @param flags - The storage flags of the matrix. With MATRIX_PACKED only the
+ * lower triangle is kept. Binary matrices keep the flags they were written
+ * with.
+ * @param distance - Out parameter for the matrix.
+ * @returns 0 on success, or -1 on error.
+ */
+int read_matrix(afra_ctx *ctx, FILE *in, int flags, matrix *distance) {
+	int first = getc(in);
+	if (first == (unsigned char)BINARY_MAGIC[0]) {
+		ungetc(first, in);
+		return read_binary_matrix(ctx, in, distance);
+	}
+	if (first != EOF) ungetc(first, in);
+
+	char *line = NULL;
+	size_t capacity = 0, line_number = 0;
+	ssize_t length;
+
+	// the header: number of taxa
+	do {
+		length = getline(&line, &capacity, in);
+		line_number++;
+	} while (length > 0 && count_tokens(line, length) == 0);
+
+	if (length < 0 && ferror(in)) {
+		free(line);
+		return afra_fail(ctx, AFRA_ERROR_IO, "read error: %s", strerror(errno));
+	}
+
+	char *end;
+	errno = 0;
+	size_t matrix_size = length > 0 ? strtoull(line, &end, 10) : 0;
+	int check = length <= 0 || errno || end == line ||
+	            count_tokens(line, length) != 1;
+	free(line);
+
+	if (check) {
+		return afra_fail(ctx, AFRA_ERROR_FORMAT,
+		                 "format error in line %zu: expected the number of "
+		                 "taxa",
+		                 line_number);
+	}
+
+	if (matrix_init(distance, matrix_size, flags) != 0) {
+		return afra_fail(ctx, AFRA_ERROR_FORMAT,
+		                 "format error in line %zu: expected phylip-style "
+		                 "matrix",
+		                 line_number);
+	}
+	memset(distance->names, 0, matrix_size * sizeof(char *));
+
+	phylip_row *rows = scratch_get(&ctx->scratch, matrix_size * sizeof(phylip_row));
+	phylip_text text = {};
+	int triangular = 0;
+
+	if (!rows) {
+		check = afra_fail(ctx, AFRA_ERROR_MEMORY, "Out of memory");
+	} else {
+		check = phylip_split(ctx, in, matrix_size, &text, rows, &line_number,
+		                     &triangular);
+	}
+
+	size_t error_row = matrix_size, error_offset = 0;
+
+	if (!check) {
+#pragma omp parallel for schedule(dynamic, 16) num_threads(ctx->threads)
+		for (size_t i = 0; i < matrix_size; i++) {
+			size_t offset = parse_row(distance, &text, &rows[i], i, triangular);
+			if (offset) {
+#pragma omp critical
+				if (i < error_row) {
+					error_row = i;
+					error_offset = offset - 1;
+				}
+			}
+		}
+	}
+
+	if (!check && error_row < matrix_size) {
+		check = phylip_error(ctx, &text, &rows[error_row], error_offset,
+		                     "expected a number");
+	}
+
+	if (!check && matrix_names(distance, (const char *const *)distance->names) !=
+	                  0) {
+		check = afra_fail(ctx, AFRA_ERROR_MEMORY, "Out of memory");
 	}
 
-	return distance;
+	scratch_put(&ctx->scratch, text.data);
+	scratch_put(&ctx->scratch, rows);
 
-format_error:
-	errx(1, "format error: expected phylip-style matrix");
+	if (check) matrix_free(distance);
+	return check;
 }
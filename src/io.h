@@ -14,7 +14,12 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include "matrix.h"
 #pragma once
 
-matrix read_matrix(FILE *in);
+#include <stdio.h>
+
+#include "global.h"
+#include "matrix.h"
+
+int read_matrix(afra_ctx *, FILE *in, int flags, matrix *distance);
+int write_binary_matrix(FILE *out, const matrix *mx);
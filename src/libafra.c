@@ -0,0 +1,424 @@
+/*
+ * Copyright (C) 2015 - 2016  Fabian Klötzl
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "afra.h"
+#include "global.h"
+#include "graph.h"
+#include "io.h"
+#include "matrix.h"
+#include "quartet.h"
+
+struct afra_matrix {
+	matrix distance;
+};
+
+static void *default_malloc(size_t size, void *data) {
+	(void)data;
+	return malloc(size);
+}
+
+static void default_free(void *ptr, void *data) {
+	(void)data;
+	free(ptr);
+}
+
+static void *ctx_malloc(afra_ctx *ctx, size_t size) {
+	return ctx->allocator.malloc(size, ctx->allocator.data);
+}
+
+static void ctx_free(afra_ctx *ctx, void *ptr) {
+	if (ptr) ctx->allocator.free(ptr, ctx->allocator.data);
+}
+
+/** @brief Create a context with the default settings: all processors, exact
+ * support values and classic neighbor joining.
+ *
+ * @param allocator - The functions to allocate the context, matrices and
+ * trees with; NULL for malloc() and free(). Scratch memory of the analyses
+ * always comes from malloc().
+ * @returns the context, or NULL if out of memory.
+ */
+afra_ctx *afra_new(const afra_allocator *allocator) {
+	afra_allocator fallback = {.malloc = default_malloc, .free = default_free};
+	if (!allocator || !allocator->malloc || !allocator->free) {
+		allocator = &fallback;
+	}
+
+	afra_ctx *ctx = allocator->malloc(sizeof(afra_ctx), allocator->data);
+	if (!ctx) return NULL;
+
+	*ctx = (afra_ctx){.threads = 1, .allocator = *allocator};
+#ifdef _OPENMP
+	ctx->threads = omp_get_num_procs();
+#endif
+
+	return ctx;
+}
+
+void afra_free(afra_ctx *ctx) {
+	if (!ctx) return;
+	scratch_free(&ctx->scratch);
+	afra_allocator allocator = ctx->allocator;
+	allocator.free(ctx, allocator.data);
+}
+
+/** @brief Record an error in the context. Only the first error is kept, as
+ * later ones are usually its consequences. Thread-safe.
+ *
+ * @param ctx - The context.
+ * @param error - The error code.
+ * @param format - A printf-style description.
+ * @returns -1.
+ */
+int afra_fail(afra_ctx *ctx, int error, const char *format, ...) {
+#pragma omp critical(afra_fail)
+	if (!ctx->error) {
+		va_list args;
+		va_start(args, format);
+		vsnprintf(ctx->message, sizeof(ctx->message), format, args);
+		va_end(args);
+		ctx->error = error;
+	}
+
+	return -1;
+}
+
+/** @brief Check whether an error has been recorded, e.g. by another task. */
+int afra_failed(afra_ctx *ctx) {
+	int failed;
+#pragma omp critical(afra_fail)
+	failed = ctx->error != AFRA_OK;
+	return failed;
+}
+
+/** @brief Forget the error of a previous call. */
+void afra_clear(afra_ctx *ctx) {
+	ctx->error = AFRA_OK;
+	ctx->message[0] = '\0';
+}
+
+/** @brief Set the number of threads used by an analysis.
+ *
+ * @returns AFRA_OK, or AFRA_ERROR_ARGUMENT if threads is not positive.
+ */
+int afra_set_threads(afra_ctx *ctx, int threads) {
+	afra_clear(ctx);
+	if (threads < 1) {
+		afra_fail(ctx, AFRA_ERROR_ARGUMENT, "invalid number of threads %d",
+		          threads);
+		return ctx->error;
+	}
+	ctx->threads = threads;
+	return AFRA_OK;
+}
+
+/** @brief Estimate the support values from random quartets.
+ *
+ * @param samples - The number of quartets per branch; 0 for exact support
+ * values.
+ * @param seed - The seed of the random numbers.
+ * @returns AFRA_OK.
+ */
+int afra_set_samples(afra_ctx *ctx, size_t samples, unsigned long seed) {
+	afra_clear(ctx);
+	ctx->samples = samples;
+	ctx->seed = seed;
+	return AFRA_OK;
+}
+
+int afra_set_nj(afra_ctx *ctx, enum afra_nj nj) {
+	afra_clear(ctx);
+	if (nj != AFRA_NJ_CLASSIC && nj != AFRA_NJ_RAPID) {
+		afra_fail(ctx, AFRA_ERROR_ARGUMENT, "invalid neighbor joining variant");
+		return ctx->error;
+	}
+	ctx->nj = nj;
+	return AFRA_OK;
+}
+
+/** @brief Set the storage flags of matrices created afterwards.
+ *
+ * @param flags - A combination of AFRA_PACKED and AFRA_FLOAT.
+ * @returns AFRA_OK, or AFRA_ERROR_ARGUMENT for unknown flags.
+ */
+int afra_set_storage(afra_ctx *ctx, int flags) {
+	afra_clear(ctx);
+	if (flags & ~(AFRA_PACKED | AFRA_FLOAT)) {
+		afra_fail(ctx, AFRA_ERROR_ARGUMENT, "invalid storage flags %d", flags);
+		return ctx->error;
+	}
+	ctx->flags = flags;
+	return AFRA_OK;
+}
+
+/** @brief Select how quartets are counted. All kernels yield the same
+ * support values.
+ *
+ * @param name - One of "scalar", "avx2", "avx512", "mixed" or "sorted", or
+ * NULL for the widest vector unit of the CPU, the default.
+ * @returns AFRA_OK, or AFRA_ERROR_ARGUMENT if the kernel is unknown or not
+ * supported by the CPU.
+ */
+int afra_set_kernel(afra_ctx *ctx, const char *name) {
+	afra_clear(ctx);
+	if (quartet_kernel(ctx, name) != 0) {
+		afra_fail(ctx, AFRA_ERROR_ARGUMENT,
+		          "invalid or unsupported kernel '%s'", name);
+		return ctx->error;
+	}
+	return AFRA_OK;
+}
+
+/** @brief A description of the last error, or the empty string. */
+const char *afra_message(const afra_ctx *ctx) {
+	return ctx->message;
+}
+
+const char *afra_strerror(int error) {
+	switch (error) {
+	case AFRA_OK:
+		return "success";
+	case AFRA_ERROR_MEMORY:
+		return "out of memory";
+	case AFRA_ERROR_IO:
+		return "input/output error";
+	case AFRA_ERROR_FORMAT:
+		return "format error";
+	case AFRA_ERROR_TAXA:
+		return "too few taxa";
+	case AFRA_ERROR_ARGUMENT:
+		return "invalid argument";
+	default:
+		return "unknown error";
+	}
+}
+
+/** @brief Read a distance matrix in PHYLIP or binary format.
+ *
+ * @param ctx - The context.
+ * @param in - The stream to read from.
+ * @param out - Out parameter for the matrix. Free with afra_matrix_free().
+ * @returns AFRA_OK or an error code.
+ */
+int afra_matrix_read(afra_ctx *ctx, FILE *in, afra_matrix **out) {
+	afra_clear(ctx);
+	*out = NULL;
+
+	if (!in) {
+		afra_fail(ctx, AFRA_ERROR_ARGUMENT, "no input stream");
+		return ctx->error;
+	}
+
+	afra_matrix *mx = ctx_malloc(ctx, sizeof(afra_matrix));
+	if (!mx) {
+		afra_fail(ctx, AFRA_ERROR_MEMORY, "Out of memory");
+		return ctx->error;
+	}
+
+	if (read_matrix(ctx, in, ctx->flags, &mx->distance) != 0) {
+		ctx_free(ctx, mx);
+		return ctx->error;
+	}
+
+	*out = mx;
+	return AFRA_OK;
+}
+
+/** @brief Create a distance matrix from memory.
+ *
+ * @param ctx - The context.
+ * @param size - The number of taxa.
+ * @param names - The names of the taxa.
+ * @param distances - The full square matrix, row by row.
+ * @param out - Out parameter for the matrix. Free with afra_matrix_free().
+ * @returns AFRA_OK or an error code.
+ */
+int afra_matrix_new(afra_ctx *ctx, size_t size, const char *const *names,
+                    const double *distances, afra_matrix **out) {
+	afra_clear(ctx);
+	*out = NULL;
+
+	if (!size || !names || !distances) {
+		afra_fail(ctx, AFRA_ERROR_ARGUMENT, "empty matrix");
+		return ctx->error;
+	}
+
+	afra_matrix *mx = ctx_malloc(ctx, sizeof(afra_matrix));
+	if (!mx || matrix_init(&mx->distance, size, ctx->flags) != 0) {
+		ctx_free(ctx, mx);
+		afra_fail(ctx, AFRA_ERROR_MEMORY, "Out of memory");
+		return ctx->error;
+	}
+
+	matrix *distance = &mx->distance;
+	if (matrix_names(distance, names) != 0) {
+		matrix_free(distance);
+		ctx_free(ctx, mx);
+		afra_fail(ctx, AFRA_ERROR_MEMORY, "Out of memory");
+		return ctx->error;
+	}
+
+	for (size_t i = 0; i < size; i++) {
+		for (size_t j = 0; j < size; j++) {
+			if (j <= i || !(ctx->flags & MATRIX_PACKED)) {
+				matrix_set(distance, i, j, distances[i * size + j]);
+			}
+		}
+	}
+
+	*out = mx;
+	return AFRA_OK;
+}
+
+size_t afra_matrix_size(const afra_matrix *mx) {
+	return mx->distance.size;
+}
+
+void afra_matrix_free(afra_ctx *ctx, afra_matrix *mx) {
+	if (!mx) return;
+	matrix_free(&mx->distance);
+	ctx_free(ctx, mx);
+}
+
+/** @brief Append a child to a node of the annotated tree. */
+static void tree_add(afra_tree *tree, const tree_node **source, size_t parent,
+                     const tree_node *child, double length, double support,
+                     double lower, double upper) {
+	size_t index = tree->node_count++;
+	int leaf = !child->left_branch;
+
+	tree->nodes[index] = (afra_node){.parent = parent,
+	                                 .length = length,
+	                                 .support = leaf ? NAN : support,
+	                                 .lower = leaf ? NAN : lower,
+	                                 .upper = leaf ? NAN : upper};
+	source[index] = child;
+
+	afra_node *node = &tree->nodes[parent];
+	node->children[node->child_count++] = index;
+}
+
+/** @brief Copy a tree with its support values into caller-owned memory.
+ * Nodes are numbered in breadth-first order.
+ *
+ * @returns 0 on success, or -1 if out of memory.
+ */
+static int tree_export(afra_ctx *ctx, const tree_s *baum,
+                       const matrix *distance, afra_tree *tree) {
+	size_t size = distance->size, name_bytes = 0;
+	for (size_t i = 0; i < size; i++) {
+		name_bytes += strlen(distance->names[i]) + 1;
+	}
+
+	*tree = (afra_tree){};
+	tree->nodes = ctx_malloc(ctx, (2 * size - 2) * sizeof(afra_node));
+	tree->names = ctx_malloc(ctx, name_bytes);
+	const tree_node **source = malloc((2 * size - 2) * sizeof(tree_node *));
+	if (!tree->nodes || !tree->names || !source) {
+		free(source);
+		afra_tree_free(ctx, tree);
+		return afra_fail(ctx, AFRA_ERROR_MEMORY, "Out of memory");
+	}
+
+	const tree_root *root = &baum->root;
+	tree->nodes[0] = (afra_node){
+	    .length = NAN, .support = NAN, .lower = NAN, .upper = NAN};
+	source[0] = &root->as_tree_node;
+	tree->node_count = 1;
+
+	tree_add(tree, source, 0, root->left_branch, root->left_dist,
+	         root->left_support, root->left_lower, root->left_upper);
+	tree_add(tree, source, 0, root->right_branch, root->right_dist,
+	         root->right_support, root->right_lower, root->right_upper);
+	tree_add(tree, source, 0, root->extra_branch, root->extra_dist,
+	         root->extra_support, root->extra_lower, root->extra_upper);
+
+	char *names = tree->names;
+	for (size_t k = 1; k < tree->node_count; k++) {
+		const tree_node *node = source[k];
+
+		if (!node->left_branch) {
+			size_t length = strlen(distance->names[node->index]) + 1;
+			memcpy(names, distance->names[node->index], length);
+			tree->nodes[k].name = names;
+			tree->nodes[k].taxon = node->index;
+			names += length;
+			continue;
+		}
+
+		tree_add(tree, source, k, node->left_branch, node->left_dist,
+		         node->left_support, node->left_lower, node->left_upper);
+		tree_add(tree, source, k, node->right_branch, node->right_dist,
+		         node->right_support, node->right_lower, node->right_upper);
+	}
+
+	free(source);
+	return 0;
+}
+
+/** @brief Build the neighbor joining tree of a matrix and compute the
+ * support of all its branches.
+ *
+ * @param ctx - The context.
+ * @param mx - The distance matrix.
+ * @param tree - Out parameter for the annotated tree. Free with
+ * afra_tree_free().
+ * @returns AFRA_OK or an error code.
+ */
+int afra_support(afra_ctx *ctx, const afra_matrix *mx, afra_tree *tree) {
+	afra_clear(ctx);
+	*tree = (afra_tree){};
+
+	const matrix *distance = &mx->distance;
+	if (distance->size < 4) {
+		afra_fail(ctx, AFRA_ERROR_TAXA,
+		          "this program requires at least four taxa.");
+		return ctx->error;
+	}
+
+	tree_s baum;
+	int check = ctx->nj == AFRA_NJ_RAPID
+	                ? neighbor_joining_rapid(ctx, distance, &baum)
+	                : neighbor_joining(ctx, distance, &baum);
+	if (check != 0) return ctx->error;
+
+	if (quartet_all(ctx, distance, &baum) == 0) {
+		tree_export(ctx, &baum, distance, tree);
+	}
+
+	tree_free(&baum);
+	return ctx->error;
+}
+
+void afra_tree_free(afra_ctx *ctx, afra_tree *tree) {
+	if (!tree) return;
+	ctx_free(ctx, tree->nodes);
+	ctx_free(ctx, tree->names);
+	*tree = (afra_tree){};
+}
@@ -15,12 +15,11 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include <err.h>
-#include <errno.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 
-#include "global.h"
 #include "matrix.h"
 
 /** @brief Free all memory aquired by a distance matrix.
@@ -29,37 +28,73 @@
  */
 void matrix_free(matrix *mx) {
 	if (!mx) return;
-	if (mx->names) {
-		for (size_t i = 0; i < mx->size; i++) {
-			free(mx->names[i]);
-		}
+	if (mx->mapping) {
 		free(mx->names);
+		munmap(mx->mapping, mx->mapping_size);
+		*mx = (struct matrix){};
+		return;
 	}
+	free(mx->name_data);
+	free(mx->names);
 	free(mx->data);
-	*mx = (struct matrix){0, NULL, NULL};
+	*mx = (struct matrix){};
+}
+
+/** @brief The number of cells needed to store a matrix.
+ *
+ * @param size - The matrix' size.
+ * @param flags - The storage flags.
+ * @returns the number of cells.
+ */
+size_t matrix_cells(size_t size, int flags) {
+	if (flags & MATRIX_PACKED) {
+		return size * (size + 1) / 2;
+	}
+	return size * size;
+}
+
+/** @brief The number of bytes needed to store the data of a matrix.
+ *
+ * @param size - The matrix' size.
+ * @param flags - The storage flags.
+ * @returns the number of bytes.
+ */
+size_t matrix_bytes(size_t size, int flags) {
+	size_t cell = flags & MATRIX_FLOAT ? sizeof(float) : sizeof(double);
+	return matrix_cells(size, flags) * cell;
 }
 
 /** @brief Create a new distance matrix. Will allocate enough space for the data
- * and matrix names array. The names themselves have to be stored somewhere
- * else (i.e. heap).
+ * and matrix names array. The names themselves are set with matrix_names().
  *
  * @param mx - Space for the new matrix.
  * @param size - The matrix' size.
- * @returns 0 on success.
+ * @param flags - The storage flags; see MATRIX_PACKED and MATRIX_FLOAT.
+ * @returns 0 on success, or -1 if the matrix is empty, its size in bytes
+ * does not fit into a size_t or it cannot be allocated.
  */
-int matrix_init(matrix *mx, size_t size) {
+int matrix_init(matrix *mx, size_t size, int flags) {
 	if (!mx || !size) return -1;
-	mx->size = size;
-	// potential integer overflow.
-	mx->data = malloc(size * size * sizeof(double));
+
+	// Checking the square suffices for the packed layout, too.
+	size_t cell = flags & MATRIX_FLOAT ? sizeof(float) : sizeof(double);
+	if (size > SIZE_MAX / size / cell) return -1;
+
+	*mx = (matrix){.size = size, .flags = flags};
+	mx->data = malloc(matrix_bytes(size, flags));
 	mx->names = malloc(size * sizeof(char *));
-	CHECK_MALLOC(mx->data);
-	CHECK_MALLOC(mx->names);
+	if (!mx->data || !mx->names) {
+		free(mx->data);
+		free(mx->names);
+		*mx = (matrix){};
+		return -1;
+	}
 
 	return 0;
 }
 
 /** @brief Creates a copy of a matrix. Does *not* copy the names, only data.
+ * The copy uses the same storage flags as the source.
  *
  * @param dest - The destination matrix.
  * @param src - The source matrix.
@@ -69,9 +104,55 @@ int matrix_copy(matrix *dest, const matrix *src) {
 	if (!dest || !src || !src->size) return -1;
 	size_t size = src->size;
 
-	matrix_init(dest, size);
-	memcpy(dest->data, src->data, size * size * sizeof(double));
+	int check = matrix_init(dest, size, src->flags);
+	if (check) return check;
+
+	memcpy(dest->data, src->data, matrix_bytes(size, src->flags));
 	memset(dest->names, 0, size * sizeof(char *));
 
 	return 0;
 }
+
+/** @brief Set the names of a matrix. They are copied into a single block, so
+ * a matrix needs one allocation for all its names instead of one per taxon.
+ *
+ * @param mx - The matrix.
+ * @param names - One name per taxon; may be the names of the matrix itself.
+ * @returns 0 on success, or -1 if out of memory.
+ */
+int matrix_names(matrix *mx, const char *const *names) {
+	size_t bytes = 0;
+	for (size_t i = 0; i < mx->size; i++) {
+		bytes += strlen(names[i]) + 1;
+	}
+
+	char *ptr = malloc(bytes);
+	if (!ptr) return -1;
+
+	free(mx->name_data);
+	mx->name_data = ptr;
+
+	for (size_t i = 0; i < mx->size; i++) {
+		size_t length = strlen(names[i]) + 1;
+		memcpy(ptr, names[i], length);
+		mx->names[i] = ptr;
+		ptr += length;
+	}
+
+	return 0;
+}
+
+/** @brief Check whether a matrix is symmetric. Packed matrices always are.
+ *
+ * @returns 1 if the matrix is symmetric, 0 otherwise.
+ */
+int matrix_symmetric(const matrix *mx) {
+	if (mx->flags & MATRIX_PACKED) return 1;
+
+	for (size_t i = 0; i < mx->size; i++) {
+		for (size_t j = 0; j < i; j++) {
+			if (matrix_get(mx, i, j) != matrix_get(mx, j, i)) return 0;
+		}
+	}
+	return 1;
+}
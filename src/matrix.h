@@ -18,16 +18,72 @@
 #ifndef _MATRIX_H_
 #define _MATRIX_H_ 1
 
+#include <stddef.h>
+
+/** Storage flags of a matrix. By default, the full square matrix is stored
+ * with double precision. */
+enum {
+	/** Only store the lower triangle, including the diagonal. The matrix is
+	 * assumed to be symmetric. */
+	MATRIX_PACKED = 1,
+	/** Store single precision values. */
+	MATRIX_FLOAT = 2,
+};
+
 typedef struct matrix {
 	size_t size;
-	double *data;
+	void *data;
 	char **names;
+	int flags;
+	/** The names, one after another; see matrix_names(). */
+	char *name_data;
+	/** If the matrix was mapped from a file, data and names point into this
+	 * region. */
+	void *mapping;
+	size_t mapping_size;
 } matrix;
 
-int matrix_init(matrix *, size_t);
+int matrix_init(matrix *, size_t, int flags);
 void matrix_free(matrix *);
 int matrix_copy(matrix *dest, const matrix *src);
+int matrix_names(matrix *, const char *const *names);
+int matrix_symmetric(const matrix *);
+size_t matrix_cells(size_t size, int flags);
+size_t matrix_bytes(size_t size, int flags);
+
+static inline size_t matrix_offset(const matrix *mx, size_t i, size_t j) {
+	if (mx->flags & MATRIX_PACKED) {
+		if (i < j) {
+			size_t temp = i;
+			i = j;
+			j = temp;
+		}
+		return i * (i + 1) / 2 + j;
+	}
+	return i * mx->size + j;
+}
+
+static inline double matrix_get(const matrix *mx, size_t i, size_t j) {
+	size_t offset = matrix_offset(mx, i, j);
+	if (mx->flags & MATRIX_FLOAT) {
+		return ((const float *)mx->data)[offset];
+	}
+	return ((const double *)mx->data)[offset];
+}
+
+static inline void matrix_set(matrix *mx, size_t i, size_t j, double value) {
+	size_t offset = matrix_offset(mx, i, j);
+	if (mx->flags & MATRIX_FLOAT) {
+		((float *)mx->data)[offset] = value;
+	} else {
+		((double *)mx->data)[offset] = value;
+	}
+}
+
+#define MATRIX_CELL(MATRIX, I, J) (matrix_get(&(MATRIX), (I), (J)))
 
-#define MATRIX_CELL(MATRIX, I, J) ((MATRIX).data[(I) * (MATRIX).size + (J)])
+/** Direct access to a matrix without storage flags. */
+#define MATRIX_SQUARE_CELL(MATRIX, I, J)                                       \
+	(((double *)(MATRIX).data)[(I) * (MATRIX).size + (J)])
 
 #endif
@@ -14,117 +14,789 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include <err.h>
 #include <errno.h>
+#include <math.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 
+#include "checkpoint.h"
 #include "global.h"
 #include "quartet.h"
+#include "stats.h"
 
-double support(const matrix *distance, const char *types) {
-	const size_t size = distance->size;
+/** @brief Split the taxa into one compact index list per color class.
+ *
+ * @param lists - The lists to fill. Free with color_lists_free().
+ * @param types - The color of every taxon.
+ * @param size - The number of taxa.
+ * @returns 0 on success, or -1 on error.
+ */
+int color_lists_init(color_lists *lists, const char *types, size_t size) {
+	if (!lists || !types) return -1;
+	*lists = (color_lists){};
+
+	size_t offset[4] = {0};
+	for (size_t i = 0; i < size; i++) {
+		lists->count[(int)types[i]]++;
+	}
+
+	lists->pool = malloc(size * sizeof(size_t));
+	if (!lists->pool) return -1;
+
+	size_t sum = 0;
+	for (int k = 0; k < 4; k++) {
+		lists->index[k] = lists->pool + sum;
+		sum += lists->count[k];
+	}
+
+	for (size_t i = 0; i < size; i++) {
+		int k = types[i];
+		lists->index[k][offset[k]++] = i;
+	}
+
+	return 0;
+}
+
+void color_lists_free(color_lists *lists) {
+	if (!lists) return;
+	free(lists->pool);
+	*lists = (color_lists){};
+}
+
+static double *tile_copy(double **dest, const matrix *distance,
+                         const size_t *rows, size_t row_count,
+                         const size_t *cols, size_t col_count) {
+	double *tile = *dest;
+	for (size_t i = 0; i < row_count; i++) {
+		for (size_t j = 0; j < col_count; j++) {
+			tile[i * col_count + j] = MATRIX_CELL(*distance, rows[i], cols[j]);
+		}
+	}
+	*dest += row_count * col_count;
+	return tile;
+}
+
+/** @brief Copy all distances needed to score a branch into contiguous tiles.
+ *
+ * Only the six distance blocks between the four color classes are used by
+ * the four-point condition. Having them laid out row by row turns the inner
+ * loop of the quartet count into a linear scan.
+ *
+ * @param pool - The tiles are stored in a buffer of this pool.
+ * @param tiles - The tiles to fill. Free with quartet_tiles_free().
+ * @param distance - The distance matrix.
+ * @param lists - The four color classes of the branch.
+ * @returns 0 on success, or -1 on error.
+ */
+int quartet_tiles_init(scratch_pool *pool, quartet_tiles *tiles,
+                       const matrix *distance, const color_lists *lists) {
+	if (!tiles || !distance || !lists) return -1;
+	*tiles = (quartet_tiles){};
+
+	size_t a = lists->count[SET_A], b = lists->count[SET_B];
+	size_t c = lists->count[SET_C], d = lists->count[SET_D];
+	const size_t *A = lists->index[SET_A], *B = lists->index[SET_B];
+	const size_t *C = lists->index[SET_C], *D = lists->index[SET_D];
+
+	tiles->a_size = a;
+	tiles->b_size = b;
+	tiles->c_size = c;
+	tiles->d_size = d;
+
+	size_t cells = a * b + c * d + a * c + b * d + a * d + b * c;
+	tiles->pool = scratch_get(pool, cells * sizeof(double));
+	if (!tiles->pool) return -1;
+	tiles->scratch = pool;
+
+	double *ptr = tiles->pool;
+	tiles->ab = tile_copy(&ptr, distance, A, a, B, b);
+	tiles->cd = tile_copy(&ptr, distance, C, c, D, d);
+	tiles->ac = tile_copy(&ptr, distance, A, a, C, c);
+	tiles->bd = tile_copy(&ptr, distance, B, b, D, d);
+	tiles->ad = tile_copy(&ptr, distance, A, a, D, d);
+	tiles->bc = tile_copy(&ptr, distance, B, b, C, c);
+
+	return 0;
+}
+
+void quartet_tiles_free(scratch_pool *pool, quartet_tiles *tiles) {
+	if (!tiles) return;
+	scratch_put(pool, tiles->pool);
+	scratch_put(pool, tiles->single.pool);
+	*tiles = (quartet_tiles){};
+}
+
+/** @brief Count the quartets of a branch that do not support it.
+ *
+ * A quartet (a,b,c,d) supports the branch ab|cd, if neither of the two other
+ * topologies is strictly shorter. This is the portable version; see
+ * quartet_count() for the dispatch to vectorized kernels.
+ *
+ * @param tiles - The distances of the branch.
+ * @returns the number of non-supporting quartets.
+ */
+size_t quartet_count_scalar(const quartet_tiles *tiles) {
+	const size_t a_size = tiles->a_size, b_size = tiles->b_size;
+	const size_t c_size = tiles->c_size, d_size = tiles->d_size;
 
 	size_t non_supporting_counter = 0;
-	size_t quartet_counter = 0;
 
-	size_t A = 0, B, C, D;
-	for (; A < size; A++) {
-		if (types[A] != SET_A) continue;
+	for (size_t a = 0; a < a_size; a++) {
+		const double *AD = tiles->ad + a * d_size;
 
-		for (B = 0; B < size; B++) {
-			if (types[B] != SET_B) continue;
+		for (size_t b = 0; b < b_size; b++) {
+			const double *BD = tiles->bd + b * d_size;
+			const double AB = tiles->ab[a * b_size + b];
 
-			for (C = 0; C < size; C++) {
-				if (types[C] != SET_C) continue;
+			for (size_t c = 0; c < c_size; c++) {
+				const double *CD = tiles->cd + c * d_size;
+				const double AC = tiles->ac[a * c_size + c];
+				const double BC = tiles->bc[b * c_size + c];
 
-				for (D = 0; D < size; D++) {
-					if (types[D] != SET_D) continue;
+				size_t local = 0;
+				for (size_t d = 0; d < d_size; d++) {
+					double D_abcd = AB + CD[d];
+					local += ((AC + BD[d]) < D_abcd) | ((AD[d] + BC) < D_abcd);
+				}
+				non_supporting_counter += local;
+			}
+		}
+	}
 
-#define M(I, J) (MATRIX_CELL(*distance, I, J))
+	return non_supporting_counter;
+}
+
+/** Branches with fewer quartets are counted by a single task. */
+#define QUARTET_TASK_MIN ((size_t)1 << 22)
 
-					quartet_counter++;
+/** The steps per task of the sorted kernel. Each slice copies and scans the
+ * tiles again, so slices are kept large enough to hide that. */
+#define QUARTET_SORTED_TASK_MIN ((size_t)1 << 26)
+
+/** @brief Count the non-supporting quartets of a branch, split into OpenMP
+ * tasks over slices of the rows of A. The tiles and their single precision
+ * copies are stored row by row in A, so a slice is just a view into them. The
+ * sorted kernel is split over the class it sorts for instead; see
+ * quartet_sorted_slices(). The partial counts are added up in slice order
+ * once all tasks are done. Without memory for the partial counts, the branch
+ * is counted by a single task.
+ *
+ * @param ctx - The context.
+ * @param tiles - The distances of the branch.
+ * @returns the number of non-supporting quartets.
+ */
+size_t quartet_count_tasks(afra_ctx *ctx, const quartet_tiles *tiles) {
+	size_t a_size = tiles->a_size, b_size = tiles->b_size;
+	size_t c_size = tiles->c_size, d_size = tiles->d_size;
+
+	size_t per_row = b_size * c_size * d_size;
+	size_t quartets = a_size * per_row;
+	int sorted = quartet_kernel_sorted(ctx);
+
+	size_t rows = per_row ? QUARTET_TASK_MIN / per_row + 1 : a_size;
+	size_t slices = sorted
+	                    ? quartet_sorted_slices(tiles, QUARTET_SORTED_TASK_MIN)
+	                    : (a_size + rows - 1) / rows;
+	size_t *partial = slices > 1 ? malloc(slices * sizeof(size_t)) : NULL;
+
+	if (!partial) {
+		double start = ctx->stats ? stats_now() : 0;
+		size_t non_supporting_counter = quartet_count(ctx, tiles);
+		stats_busy(ctx->stats, ctx->stats ? stats_now() - start : 0);
+		progress_done(ctx->progress, 0, quartets);
+		return non_supporting_counter;
+	}
 
-					double D_abcd = M(A, B) + M(C, D);
-					if (((M(A, C) + M(B, D)) < D_abcd) ||
-					    ((M(A, D) + M(B, C)) < D_abcd)) {
-						// printf("%zu %zu %zu %zu\n", A, B, C, D);
-						non_supporting_counter++;
-					}
+	for (size_t k = 0; k < slices; k++) {
+#pragma omp task firstprivate(k) shared(partial)
+		{
+			double start = ctx->stats ? stats_now() : 0;
+			size_t done;
+
+			if (sorted) {
+				partial[k] = quartet_count_sorted_slice(tiles, k, slices);
+				done = (size_t)((double)quartets * (k + 1) / slices) -
+				       (size_t)((double)quartets * k / slices);
+			} else {
+				size_t begin = k * rows;
+				quartet_tiles slice = *tiles;
+				slice.a_size = begin + rows < a_size ? rows : a_size - begin;
+				slice.ab += begin * b_size;
+				slice.ac += begin * c_size;
+				slice.ad += begin * d_size;
+				if (slice.single.pool) {
+					slice.single.ab += begin * b_size;
+					slice.single.ac += begin * c_size;
+					slice.single.ad += begin * d_size;
 				}
+
+				partial[k] = quartet_count(ctx, &slice);
+				done = slice.a_size * per_row;
 			}
+
+			stats_busy(ctx->stats, ctx->stats ? stats_now() - start : 0);
+			progress_done(ctx->progress, 0, done);
 		}
 	}
+#pragma omp taskwait
+
+	size_t non_supporting_counter = 0;
+	for (size_t k = 0; k < slices; k++) {
+		non_supporting_counter += partial[k];
+	}
+
+	free(partial);
+	return non_supporting_counter;
+}
+
+/** @brief Compute the support of a branch from its four color classes.
+ *
+ * @param ctx - The context.
+ * @param distance - The distance matrix.
+ * @param lists - The color classes of the branch.
+ * @returns the fraction of supporting quartets, or NAN on error.
+ */
+double support_lists(afra_ctx *ctx, const matrix *distance,
+                     const color_lists *lists) {
+	double start = ctx->stats ? stats_now() : 0;
+	quartet_tiles tiles;
+	if (quartet_tiles_init(&ctx->scratch, &tiles, distance, lists) != 0) {
+		afra_fail(ctx, AFRA_ERROR_MEMORY, "Out of memory");
+		return NAN;
+	}
+	// without the copies the mixed kernel compares in double precision
+	if (quartet_kernel_mixed(ctx)) {
+		quartet_tiles_single(&ctx->scratch, &tiles);
+	}
+	stats_busy(ctx->stats, ctx->stats ? stats_now() - start : 0);
+
+	size_t non_supporting_counter = quartet_count_tasks(ctx, &tiles);
+	size_t quartet_counter = lists->count[SET_A] * lists->count[SET_B] *
+	                         lists->count[SET_C] * lists->count[SET_D];
+
+	quartet_tiles_free(&ctx->scratch, &tiles);
 
-	// printf("%zu of %zu\n", non_supporting_counter, quartet_counter);
 	return 1 - ((double)non_supporting_counter / quartet_counter);
 }
 
-void quartet_left(tree_node *current, matrix *distance) {
-	if (!current->left_branch || !current->left_branch->left_branch) return;
-	color_context cctx = {.size = distance->size,
-	                      .types = malloc(distance->size)};
-	CHECK_MALLOC(cctx.types);
+double support(afra_ctx *ctx, const matrix *distance, const char *types) {
+	color_lists lists;
+	if (color_lists_init(&lists, types, distance->size) != 0) {
+		afra_fail(ctx, AFRA_ERROR_MEMORY, "Out of memory");
+		return NAN;
+	}
 
-	colorize_dry(current->left_branch, current->right_branch, &cctx);
+	double d = support_lists(ctx, distance, &lists);
 
-	double d = support(distance, cctx.types);
-	current->left_support = d;
+	color_lists_free(&lists);
+	return d;
+}
 
-	free(cctx.types);
+/** @brief The splitmix64 generator. Small and fast, but good enough to draw
+ * quartets.
+ */
+static uint64_t splitmix64(uint64_t *state) {
+	uint64_t z = (*state += 0x9e3779b97f4a7c15);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+	return z ^ (z >> 31);
 }
 
-void quartet_right(tree_node *current, matrix *distance) {
-	if (!current->left_branch || !current->right_branch->left_branch) return;
-	color_context cctx = {.size = distance->size,
-	                      .types = malloc(distance->size)};
-	CHECK_MALLOC(cctx.types);
+static size_t draw(uint64_t *state, const size_t *list, size_t count) {
+	return list[splitmix64(state) % count];
+}
 
-	colorize_dry(current->right_branch, current->left_branch, &cctx);
+/** @brief Compute the 95% Wilson score interval of a binomial proportion.
+ *
+ * @param p - The estimated proportion.
+ * @param n - The number of trials.
+ * @param lower - Out parameter for the lower bound.
+ * @param upper - Out parameter for the upper bound.
+ */
+static void wilson_interval(double p, size_t n, double *lower, double *upper) {
+	const double z = 1.959963984540054;
+	double z2n = z * z / n;
+	double center = (p + z2n / 2) / (1 + z2n);
+	double half = z * sqrt(p * (1 - p) / n + z2n / (4 * n)) / (1 + z2n);
+
+	*lower = fmax(0.0, center - half);
+	*upper = fmin(1.0, center + half);
+}
 
-	double d = support(distance, cctx.types);
-	current->right_support = d;
+/** @brief Estimate the support of a branch from randomly drawn quartets.
+ *
+ * Draws `samples` quartets (a,b,c,d) uniformly with replacement from the four
+ * color classes. The random stream only depends on `seed` and the branch
+ * itself, so the estimate does not change with the number of threads. If
+ * there are no more quartets than samples, the exact support is computed
+ * instead.
+ *
+ * @param ctx - The context.
+ * @param distance - The distance matrix.
+ * @param lists - The color classes of the branch.
+ * @param samples - The number of quartets to draw.
+ * @param seed - The seed of the random number generator.
+ * @param lower - Out parameter for the lower bound of the 95% confidence
+ * interval.
+ * @param upper - Out parameter for the upper bound.
+ * @returns the estimated support.
+ */
+double support_sampled_lists(afra_ctx *ctx, const matrix *distance,
+                             const color_lists *lists, size_t samples,
+                             unsigned long seed, double *lower, double *upper) {
+	const size_t *A = lists->index[SET_A], *B = lists->index[SET_B];
+	const size_t *C = lists->index[SET_C], *D = lists->index[SET_D];
+	size_t a_size = lists->count[SET_A], b_size = lists->count[SET_B];
+	size_t c_size = lists->count[SET_C], d_size = lists->count[SET_D];
+
+	size_t quartet_counter = a_size * b_size * c_size * d_size;
+	if (!samples || quartet_counter <= samples) {
+		double d = support_lists(ctx, distance, lists);
+		*lower = *upper = d;
+		return d;
+	}
+
+	// Identify the branch by the first taxon of A, B and C.
+	uint64_t state = seed;
+	state ^= splitmix64(&state) + A[0];
+	state ^= splitmix64(&state) + B[0];
+	state ^= splitmix64(&state) + C[0];
+
+	size_t non_supporting_counter = 0;
+
+	for (size_t i = 0; i < samples; i++) {
+		size_t a = draw(&state, A, a_size);
+		size_t b = draw(&state, B, b_size);
+		size_t c = draw(&state, C, c_size);
+		size_t d = draw(&state, D, d_size);
+
+#define M(I, J) (MATRIX_CELL(*distance, I, J))
+
+		double D_abcd = M(a, b) + M(c, d);
+		if (((M(a, c) + M(b, d)) < D_abcd) || ((M(a, d) + M(b, c)) < D_abcd)) {
+			non_supporting_counter++;
+		}
+
+#undef M
+	}
+
+	double p = 1 - ((double)non_supporting_counter / samples);
+	wilson_interval(p, samples, lower, upper);
+	return p;
+}
+
+double support_sampled(afra_ctx *ctx, const matrix *distance,
+                       const char *types, size_t samples, unsigned long seed,
+                       double *lower, double *upper) {
+	color_lists lists;
+	if (color_lists_init(&lists, types, distance->size) != 0) {
+		afra_fail(ctx, AFRA_ERROR_MEMORY, "Out of memory");
+		return *lower = *upper = NAN;
+	}
 
-	free(cctx.types);
+	double d = support_sampled_lists(ctx, distance, &lists, samples, seed,
+	                                 lower, upper);
+
+	color_lists_free(&lists);
+	return d;
 }
 
-void quartet_node(tree_node *current, void *ctx) {
-	if (!current->left_branch) return;
+typedef struct support_entry {
+	uint64_t key[4];
+	double support;
+	int used;
+} support_entry;
 
-	// left branch
-	quartet_left(current, (matrix *)ctx);
+int support_cache_init(support_cache *cache) {
+	*cache = (support_cache){.capacity = 256};
+	cache->entries = calloc(cache->capacity, sizeof(support_entry));
+	return cache->entries ? 0 : -1;
+}
 
-	// right branch
-	quartet_right(current, (matrix *)ctx);
+void support_cache_free(support_cache *cache) {
+	if (!cache) return;
+	free(cache->entries);
+	*cache = (support_cache){};
 }
 
-void quartet_all(matrix *distance, tree_s *baum) {
-	// iterate over all nodes
+static support_entry *cache_slot(support_entry *entries, size_t capacity,
+                                 const uint64_t key[4]) {
+	size_t mask = capacity - 1;
+	size_t slot = (key[0] ^ key[1] * 3 ^ key[2] * 5 ^ key[3] * 7) & mask;
+
+	while (entries[slot].used &&
+	       memcmp(entries[slot].key, key, sizeof(entries[slot].key)) != 0) {
+		slot = (slot + 1) & mask;
+	}
+	return &entries[slot];
+}
+
+static int cache_find(support_cache *cache, const uint64_t key[4],
+                      double *support) {
+	int found;
+#pragma omp critical(support_cache)
+	{
+		support_entry *entry = cache_slot(cache->entries, cache->capacity, key);
+		found = entry->used;
+		if (found) *support = entry->support;
+	}
+	return found;
+}
+
+/** @brief Remember the support of a branch. If the table cannot grow, the
+ * value is not cached. */
+static void cache_add(support_cache *cache, const uint64_t key[4],
+                      double support) {
+#pragma omp critical(support_cache)
+	{
+		if (2 * (cache->used + 1) > cache->capacity) {
+			size_t capacity = 2 * cache->capacity;
+			support_entry *entries = calloc(capacity, sizeof(support_entry));
+			for (size_t i = 0; entries && i < cache->capacity; i++) {
+				const support_entry *old = &cache->entries[i];
+				if (old->used) *cache_slot(entries, capacity, old->key) = *old;
+			}
+			if (entries) {
+				free(cache->entries);
+				cache->entries = entries;
+				cache->capacity = capacity;
+			}
+		}
+
+		if (2 * (cache->used + 1) <= cache->capacity) {
+			support_entry *entry =
+			    cache_slot(cache->entries, cache->capacity, key);
+			if (!entry->used) cache->used++;
+			*entry = (support_entry){{key[0], key[1], key[2], key[3]},
+			                         support, 1};
+		}
+	}
+}
+
+static void swap_hash(uint64_t *x, uint64_t *y) {
+	uint64_t temp = *x;
+	*x = *y;
+	*y = temp;
+}
+
+/** @brief Identify a branch by its four clades, given as hashes. On a
+ * symmetric matrix, the support does not change if A and B, C and D or both
+ * pairs are swapped, so the key is made independent of their order. */
+static void branch_key(uint64_t key[4], uint64_t a, uint64_t b, uint64_t c,
+                       uint64_t d, int symmetric) {
+	key[0] = a;
+	key[1] = b;
+	key[2] = c;
+	key[3] = d;
+	if (!symmetric) return;
+
+	if (key[0] > key[1]) swap_hash(&key[0], &key[1]);
+	if (key[2] > key[3]) swap_hash(&key[2], &key[3]);
+	if (key[0] > key[2] || (key[0] == key[2] && key[1] > key[3])) {
+		swap_hash(&key[0], &key[2]);
+		swap_hash(&key[1], &key[3]);
+	}
+}
+
+/** An internal branch of the tree, named as in colorize_dry(). The taxa of D
+ * are a range of the doubled leaf order. */
+typedef struct branch {
+	tree_node *foo, *bar;
+	size_t d_begin, d_end;
+	double *support, *lower, *upper;
+	size_t work, id;
+	uint64_t key[4];
+} branch;
+
+static void add_branch(branch **ptr, tree_node *foo, tree_node *bar,
+                       size_t d_begin, size_t d_end, double *support,
+                       double *lower, double *upper) {
+	if (!foo->left_branch) return;
+	*(*ptr)++ =
+	    (branch){foo, bar, d_begin, d_end, support, lower, upper, 0, 0, {0}};
+}
+
+/** @brief Compute the cache keys of all branches. A clade is hashed as the
+ * exclusive or of a random number per taxon, so the hash of every range of
+ * the leaf order follows from prefix sums.
+ *
+ * @returns 0 on success, or -1 if out of memory.
+ */
+static int branch_keys(const matrix *distance, const tree_order *order,
+                       branch *branches, size_t branch_count) {
+	size_t size = distance->size;
+	uint64_t *prefix = malloc((2 * size + 1) * sizeof(uint64_t));
+	if (!prefix) return -1;
+
+	prefix[0] = 0;
+	for (size_t i = 0; i < 2 * size; i++) {
+		uint64_t state = order->leaves[i];
+		prefix[i + 1] = prefix[i] ^ splitmix64(&state);
+	}
+
+#define HASH(BEGIN, END) (prefix[END] ^ prefix[BEGIN])
+#define CLADE_HASH(NODE) HASH(ORDER_BEGIN(*order, NODE), ORDER_END(*order, NODE))
+
+	int symmetric = matrix_symmetric(distance);
+	for (size_t i = 0; i < branch_count; i++) {
+		branch *br = &branches[i];
+		branch_key(br->key, CLADE_HASH(br->foo->left_branch),
+		           CLADE_HASH(br->foo->right_branch), CLADE_HASH(br->bar),
+		           HASH(br->d_begin, br->d_end), symmetric);
+	}
+
+#undef CLADE_HASH
+#undef HASH
+
+	free(prefix);
+	return 0;
+}
+
+static int compare_work(const void *a, const void *b) {
+	const branch *x = a, *y = b;
+	if (x->work != y->work) return x->work < y->work ? 1 : -1;
+	return x->id < y->id ? -1 : x->id > y->id;
+}
+
+/** @brief Keep only the branches of shard ctx->shard. The branches, sorted
+ * by work, are dealt out to the shard with the least work so far. This only
+ * depends on the matrix and the tree, so all shards agree on the split. The
+ * supports of the dropped branches are set to NAN.
+ *
+ * @returns 0 on success, or -1 if out of memory.
+ */
+static int shard_branches(const afra_ctx *ctx, branch *branches,
+                          size_t *branch_count) {
+	size_t *load = calloc(ctx->shards, sizeof(size_t));
+	if (!load) return -1;
+
+	size_t kept = 0;
+	for (size_t i = 0; i < *branch_count; i++) {
+		branch *br = &branches[i];
+
+		size_t lightest = 0;
+		for (size_t j = 1; j < ctx->shards; j++) {
+			if (load[j] < load[lightest]) lightest = j;
+		}
+		load[lightest] += br->work;
+
+		if (lightest == ctx->shard) {
+			branches[kept++] = *br;
+		} else {
+			*br->support = *br->lower = *br->upper = NAN;
+		}
+	}
+
+	*branch_count = kept;
+	free(load);
+	return 0;
+}
+
+static void slice(color_lists *lists, int color, const tree_order *order,
+                  size_t begin, size_t end) {
+	lists->index[color] = order->leaves + begin;
+	lists->count[color] = end - begin;
+}
+
+/** @brief Compute the support of a single branch. The color classes are
+ * slices of the leaf order, so no coloring is necessary.
+ */
+static void quartet_branch(afra_ctx *ctx, const matrix *distance,
+                           const tree_order *order, const branch *br) {
+	color_lists lists = {};
+	tree_node *A = br->foo->left_branch, *B = br->foo->right_branch;
+
+	slice(&lists, SET_A, order, ORDER_BEGIN(*order, A), ORDER_END(*order, A));
+	slice(&lists, SET_B, order, ORDER_BEGIN(*order, B), ORDER_END(*order, B));
+	slice(&lists, SET_C, order, ORDER_BEGIN(*order, br->bar),
+	      ORDER_END(*order, br->bar));
+	slice(&lists, SET_D, order, br->d_begin, br->d_end);
+
+	double start = ctx->stats ? stats_now() : 0;
+	size_t quartets = lists.count[SET_A] * lists.count[SET_B] *
+	                  lists.count[SET_C] * lists.count[SET_D];
+	size_t samples = ctx->samples;
+
+	if (samples) {
+		*br->support = support_sampled_lists(ctx, distance, &lists, samples,
+		                                     ctx->seed, br->lower, br->upper);
+		if (quartets > samples) {
+			// exact counts report their busy time and progress themselves
+			stats_busy(ctx->stats, ctx->stats ? stats_now() - start : 0);
+			progress_done(ctx->progress, 0, quartets);
+			quartets = samples;
+		}
+	} else {
+		*br->support = support_lists(ctx, distance, &lists);
+		*br->lower = *br->upper = *br->support;
+	}
+
+	if (ctx->stats) {
+		stats_branch_done(ctx->stats, stats_now() - start, lists.count[SET_A],
+		                  lists.count[SET_B], lists.count[SET_C],
+		                  lists.count[SET_D], quartets);
+	}
+}
+
+/** @brief Compute the support values of all internal branches.
+ *
+ * The leaves are ordered once, such that the four color classes of every
+ * branch are slices of that order. Then every branch, including the ones at
+ * the root, becomes an OpenMP task, the heaviest first. Heavy branches split
+ * their count into further tasks; see quartet_count_tasks(). Branches
+ * already in ctx->cache, from an earlier tree on the same matrix, are not
+ * counted again. With ctx->shards set, only the branches of one shard are
+ * computed, and the others are left NAN; see shard_branches().
+ *
+ * @param ctx - The context.
+ * @param distance - The distance matrix.
+ * @param baum - The tree to annotate.
+ * @returns 0 on success, or -1 on error.
+ */
+int quartet_all(afra_ctx *ctx, const matrix *distance, tree_s *baum) {
 	size_t size = distance->size;
 	tree_node *inner_nodes = baum->pool + size;
+	tree_root *root = &baum->root;
+
+	tree_order order;
+	if (tree_order_init(&order, baum) != 0) {
+		return afra_fail(ctx, AFRA_ERROR_MEMORY, "Out of memory");
+	}
+
+	branch *branches = malloc(2 * size * sizeof(branch));
+	if (!branches) {
+		tree_order_free(&order);
+		return afra_fail(ctx, AFRA_ERROR_MEMORY, "Out of memory");
+	}
+	branch *ptr = branches;
 
-#pragma omp parallel for schedule(dynamic) num_threads(THREADS)
 	for (size_t i = 0; i < size - 2; i++) {
-		quartet_node(&inner_nodes[i], distance);
+		tree_node *current = &inner_nodes[i];
+		if (!current->left_branch) continue;
+
+		// D is everything outside of current
+		size_t d_begin = ORDER_END(order, current);
+		size_t d_end = ORDER_BEGIN(order, current) + size;
+
+		add_branch(&ptr, current->left_branch, current->right_branch, d_begin,
+		           d_end, &current->left_support, &current->left_lower,
+		           &current->left_upper);
+		add_branch(&ptr, current->right_branch, current->left_branch, d_begin,
+		           d_end, &current->right_support, &current->right_lower,
+		           &current->right_upper);
 	}
 
-	tree_root *root = &baum->root;
-	quartet_node(&root->as_tree_node, distance);
+	tree_node *extra = root->extra_branch, *right = root->right_branch;
+	add_branch(&ptr, root->left_branch, right, ORDER_BEGIN(order, extra),
+	           ORDER_END(order, extra), &root->left_support, &root->left_lower,
+	           &root->left_upper);
+	add_branch(&ptr, right, root->left_branch, ORDER_BEGIN(order, extra),
+	           ORDER_END(order, extra), &root->right_support,
+	           &root->right_lower, &root->right_upper);
+	add_branch(&ptr, extra, root->left_branch, ORDER_BEGIN(order, right),
+	           ORDER_END(order, right), &root->extra_support,
+	           &root->extra_lower, &root->extra_upper);
+
+	size_t branch_count = ptr - branches;
+
+	checkpoint *cp = ctx->checkpoint;
+	uint64_t key = cp ? checkpoint_key(ctx, distance, baum) : 0;
+	size_t work = 0;
+
+	for (size_t i = 0; i < branch_count; i++) {
+		branch *br = &branches[i];
+		br->id = i;
+
+		size_t a = ORDER_END(order, br->foo->left_branch) -
+		           ORDER_BEGIN(order, br->foo->left_branch);
+		size_t b = ORDER_END(order, br->foo->right_branch) -
+		           ORDER_BEGIN(order, br->foo->right_branch);
+		size_t c = ORDER_END(order, br->bar) - ORDER_BEGIN(order, br->bar);
+		br->work = a * b * c * (br->d_end - br->d_begin);
+	}
 
-	if (root->extra_branch->left_branch) {
-		// Support Value for Root→Extra
-		color_context cctx = {.size = distance->size,
-		                      .types = malloc(distance->size)};
-		CHECK_MALLOC(cctx.types);
+	// start with the heaviest branches
+	qsort(branches, branch_count, sizeof(branch), compare_work);
 
-		colorize_dry(root->extra_branch, root->left_branch, &cctx);
+	if (ctx->shards && shard_branches(ctx, branches, &branch_count) != 0) {
+		free(branches);
+		tree_order_free(&order);
+		return afra_fail(ctx, AFRA_ERROR_MEMORY, "Out of memory");
+	}
 
-		double d = support(distance, cctx.types);
-		root->extra_support = d;
+	for (size_t i = 0; i < branch_count; i++) {
+		work += branches[i].work;
+	}
+	progress_add(ctx->progress, branch_count, work);
+
+	// sampled supports depend on the order of the taxa; they are not cached
+	support_cache *cache = ctx->samples ? NULL : ctx->cache;
+	if (cache && branch_keys(distance, &order, branches, branch_count) != 0) {
+		cache = NULL;
+	}
+
+#pragma omp parallel num_threads(ctx->threads)
+#pragma omp single
+	for (size_t i = 0; i < branch_count && !afra_failed(ctx); i++) {
+		branch *br = &branches[i];
+
+		checkpoint_record record;
+		if (cp && checkpoint_find(cp, key, br->id, &record)) {
+			*br->support = record.support;
+			*br->lower = record.lower;
+			*br->upper = record.upper;
+			progress_done(ctx->progress, 1, br->work);
+			continue;
+		}
+
+		if (cp && !cp->file) {
+			afra_fail(ctx, AFRA_ERROR_ARGUMENT,
+			          "Branch %zu is missing from the merged shards", br->id);
+			break;
+		}
+
+		if (cache && cache_find(cache, br->key, br->support)) {
+			*br->lower = *br->upper = *br->support;
+			progress_done(ctx->progress, 1, br->work);
+
+			// a merge of shards needs every branch, even the cached ones
+			record = (checkpoint_record){key, br->id, *br->support,
+			                             *br->lower, *br->upper};
+			if (cp && checkpoint_save(cp, &record) != 0) {
+				afra_fail(ctx, AFRA_ERROR_IO, "%s: %s", cp->file_name,
+				          strerror(errno));
+			}
+			continue;
+		}
+
+#pragma omp task firstprivate(br)
+		if (!afra_failed(ctx)) {
+			quartet_branch(ctx, distance, &order, br);
+			progress_done(ctx->progress, 1, 0);
+
+			if (cache && !afra_failed(ctx)) {
+				cache_add(cache, br->key, *br->support);
+			}
+
+			checkpoint_record done = {key, br->id, *br->support, *br->lower,
+			                          *br->upper};
+			if (cp && !afra_failed(ctx) && checkpoint_save(cp, &done) != 0) {
+				afra_fail(ctx, AFRA_ERROR_IO, "%s: %s", cp->file_name,
+				          strerror(errno));
+			}
+		}
+	}
 
-		free(cctx.types);
+	if (cp && cp->file && checkpoint_flush(cp) != 0) {
+		afra_fail(ctx, AFRA_ERROR_IO, "%s: %s", cp->file_name, strerror(errno));
 	}
+
+	free(branches);
+	tree_order_free(&order);
+
+	return afra_failed(ctx) ? -1 : 0;
 }
 
 void colorize_process(tree_node *current, void *vctx) {
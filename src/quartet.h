@@ -17,12 +17,13 @@
 #ifndef QUARTET_H
 #define QUARTET_H
 
+#include "global.h"
 #include "graph.h"
 #include "matrix.h"
 
 int quartet_root(matrix *distance, tree_root *root);
-void quartet_all(matrix *distance, tree_s *baum);
-double support(const matrix *distance, const char *types);
+int quartet_all(afra_ctx *, const matrix *distance, tree_s *baum);
+double support(afra_ctx *, const matrix *distance, const char *types);
 
 // A set of four colors.
 enum { SET_D, SET_A, SET_B, SET_C };
@@ -36,4 +37,73 @@ typedef struct color_context {
 void colorize(tree_node *current, color_context *);
 void colorize_dry(tree_node *foo, tree_node *bar, color_context *cctx);
 
+/** The taxa of each color class as a compact list of matrix indices. */
+typedef struct color_lists {
+	size_t *index[4];
+	size_t count[4];
+	size_t *pool;
+} color_lists;
+
+int color_lists_init(color_lists *, const char *types, size_t size);
+void color_lists_free(color_lists *);
+
+/** Single precision copies of the tiles for the mixed precision kernel, and a
+ * bound on the error of the differences computed from them. */
+typedef struct single_tiles {
+	float *ab, *cd, *ac, *bd, *ad, *bc;
+	float *pool;
+	float bound;
+} single_tiles;
+
+/** Per-branch copies of the distances between the color classes. Each tile is
+ * stored row-major, i.e. `ab[i * b_size + j]` is the distance between the i-th
+ * taxon of A and the j-th taxon of B. `single` is empty unless filled by
+ * quartet_tiles_single(). The kernels take temporary memory from `scratch`,
+ * the pool the tiles are stored in. */
+typedef struct quartet_tiles {
+	size_t a_size, b_size, c_size, d_size;
+	double *ab, *cd, *ac, *bd, *ad, *bc;
+	double *pool;
+	single_tiles single;
+	scratch_pool *scratch;
+} quartet_tiles;
+
+int quartet_tiles_init(scratch_pool *, quartet_tiles *, const matrix *,
+                       const color_lists *);
+void quartet_tiles_free(scratch_pool *, quartet_tiles *);
+int quartet_tiles_single(scratch_pool *, quartet_tiles *);
+size_t quartet_count(const afra_ctx *, const quartet_tiles *);
+size_t quartet_count_tasks(afra_ctx *, const quartet_tiles *);
+int quartet_kernel(afra_ctx *, const char *name);
+size_t quartet_count_scalar(const quartet_tiles *);
+size_t quartet_count_avx2(const quartet_tiles *);
+size_t quartet_count_avx512(const quartet_tiles *);
+size_t quartet_count_mixed(const quartet_tiles *);
+size_t quartet_count_sorted(const quartet_tiles *);
+size_t quartet_count_sorted_slice(const quartet_tiles *, size_t slice,
+                                  size_t slices);
+size_t quartet_sorted_slices(const quartet_tiles *, size_t work);
+int quartet_kernel_sorted(const afra_ctx *);
+int quartet_kernel_mixed(const afra_ctx *);
+
+double support_lists(afra_ctx *, const matrix *distance,
+                     const color_lists *lists);
+double support_sampled(afra_ctx *, const matrix *distance, const char *types,
+                       size_t samples, unsigned long seed, double *lower,
+                       double *upper);
+double support_sampled_lists(afra_ctx *, const matrix *distance,
+                             const color_lists *lists, size_t samples,
+                             unsigned long seed, double *lower, double *upper);
+
+/** Exact support values of branches, keyed by the four clades around a
+ * branch. Trees scored against the same matrix share most of their branches,
+ * so each distinct branch is counted only once. */
+typedef struct support_cache {
+	struct support_entry *entries;
+	size_t capacity, used;
+} support_cache;
+
+int support_cache_init(support_cache *);
+void support_cache_free(support_cache *);
+
 #endif
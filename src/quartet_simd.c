@@ -0,0 +1,480 @@
+/** @file Vectorized kernels for counting non-supporting quartets.
+ *
+ * Copyright (C) 2016  Fabian Klötzl
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <float.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "quartet.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define HAVE_X86_DISPATCH 1
+#include <immintrin.h>
+#endif
+
+#ifdef HAVE_X86_DISPATCH
+
+/* All kernels evaluate exactly the same floating point expressions as
+ * quartet_count_scalar(), only for several taxa of D at once. Thus the counts
+ * are identical. */
+
+__attribute__((target("avx2"))) size_t
+quartet_count_avx2(const quartet_tiles *tiles) {
+	const size_t a_size = tiles->a_size, b_size = tiles->b_size;
+	const size_t c_size = tiles->c_size, d_size = tiles->d_size;
+	const size_t d_vec = d_size - d_size % 4;
+
+	size_t non_supporting_counter = 0;
+
+	for (size_t a = 0; a < a_size; a++) {
+		const double *AD = tiles->ad + a * d_size;
+
+		for (size_t b = 0; b < b_size; b++) {
+			const double *BD = tiles->bd + b * d_size;
+			const double AB = tiles->ab[a * b_size + b];
+			const __m256d vAB = _mm256_set1_pd(AB);
+
+			for (size_t c = 0; c < c_size; c++) {
+				const double *CD = tiles->cd + c * d_size;
+				const double AC = tiles->ac[a * c_size + c];
+				const double BC = tiles->bc[b * c_size + c];
+				const __m256d vAC = _mm256_set1_pd(AC);
+				const __m256d vBC = _mm256_set1_pd(BC);
+
+				// each lane counts down by one for every mismatch
+				__m256i acc = _mm256_setzero_si256();
+
+				size_t d = 0;
+				for (; d < d_vec; d += 4) {
+					__m256d D_abcd = _mm256_add_pd(vAB, _mm256_loadu_pd(CD + d));
+					__m256d lhs1 = _mm256_add_pd(vAC, _mm256_loadu_pd(BD + d));
+					__m256d lhs2 = _mm256_add_pd(_mm256_loadu_pd(AD + d), vBC);
+					__m256d mask =
+					    _mm256_or_pd(_mm256_cmp_pd(lhs1, D_abcd, _CMP_LT_OQ),
+					                 _mm256_cmp_pd(lhs2, D_abcd, _CMP_LT_OQ));
+					acc = _mm256_add_epi64(acc, _mm256_castpd_si256(mask));
+				}
+
+				__m128i sum = _mm_add_epi64(_mm256_castsi256_si128(acc),
+				                            _mm256_extracti128_si256(acc, 1));
+				sum = _mm_add_epi64(sum, _mm_unpackhi_epi64(sum, sum));
+				size_t local = -(size_t)_mm_cvtsi128_si64(sum);
+
+				for (; d < d_size; d++) {
+					double D_abcd = AB + CD[d];
+					local += ((AC + BD[d]) < D_abcd) | ((AD[d] + BC) < D_abcd);
+				}
+				non_supporting_counter += local;
+			}
+		}
+	}
+
+	return non_supporting_counter;
+}
+
+__attribute__((target("avx512f"))) size_t
+quartet_count_avx512(const quartet_tiles *tiles) {
+	const size_t a_size = tiles->a_size, b_size = tiles->b_size;
+	const size_t c_size = tiles->c_size, d_size = tiles->d_size;
+	const size_t d_vec = d_size - d_size % 8;
+	const __mmask8 tail = (1u << (d_size % 8)) - 1;
+
+	size_t non_supporting_counter = 0;
+
+	for (size_t a = 0; a < a_size; a++) {
+		const double *AD = tiles->ad + a * d_size;
+
+		for (size_t b = 0; b < b_size; b++) {
+			const double *BD = tiles->bd + b * d_size;
+			const __m512d vAB = _mm512_set1_pd(tiles->ab[a * b_size + b]);
+
+			for (size_t c = 0; c < c_size; c++) {
+				const double *CD = tiles->cd + c * d_size;
+				const __m512d vAC = _mm512_set1_pd(tiles->ac[a * c_size + c]);
+				const __m512d vBC = _mm512_set1_pd(tiles->bc[b * c_size + c]);
+
+				size_t local = 0;
+				size_t d = 0;
+				for (; d < d_vec; d += 8) {
+					__m512d D_abcd = _mm512_add_pd(vAB, _mm512_loadu_pd(CD + d));
+					__m512d lhs1 = _mm512_add_pd(vAC, _mm512_loadu_pd(BD + d));
+					__m512d lhs2 = _mm512_add_pd(_mm512_loadu_pd(AD + d), vBC);
+					__mmask8 mask =
+					    _mm512_cmp_pd_mask(lhs1, D_abcd, _CMP_LT_OQ) |
+					    _mm512_cmp_pd_mask(lhs2, D_abcd, _CMP_LT_OQ);
+					local += __builtin_popcount(mask);
+				}
+
+				if (tail) {
+					__m512d D_abcd = _mm512_add_pd(
+					    vAB, _mm512_maskz_loadu_pd(tail, CD + d));
+					__m512d lhs1 = _mm512_add_pd(
+					    vAC, _mm512_maskz_loadu_pd(tail, BD + d));
+					__m512d lhs2 = _mm512_add_pd(
+					    _mm512_maskz_loadu_pd(tail, AD + d), vBC);
+					__mmask8 mask =
+					    _mm512_mask_cmp_pd_mask(tail, lhs1, D_abcd, _CMP_LT_OQ) |
+					    _mm512_mask_cmp_pd_mask(tail, lhs2, D_abcd, _CMP_LT_OQ);
+					local += __builtin_popcount(mask);
+				}
+
+				non_supporting_counter += local;
+			}
+		}
+	}
+
+	return non_supporting_counter;
+}
+
+/* The mixed precision kernels compare the sums in single precision, twice as
+ * many taxa of D at once, and read half as many bytes. If the smaller of
+ * AC + BD and AD + BC is within `bound` of AB + CD, the order in double
+ * precision is not certain, and these taxa are compared again exactly like in
+ * quartet_count_scalar(). Thus the counts are identical, too. */
+
+__attribute__((target("avx2"))) static size_t
+count_mixed_avx2(const quartet_tiles *tiles, const single_tiles *ft) {
+	const size_t a_size = tiles->a_size, b_size = tiles->b_size;
+	const size_t c_size = tiles->c_size, d_size = tiles->d_size;
+	const size_t d_vec = d_size - d_size % 8;
+	const __m256 bound = _mm256_set1_ps(ft->bound);
+	const __m256 neg_bound = _mm256_set1_ps(-ft->bound);
+
+	size_t non_supporting_counter = 0;
+
+	for (size_t a = 0; a < a_size; a++) {
+		const double *AD = tiles->ad + a * d_size;
+		const float *fAD = ft->ad + a * d_size;
+
+		for (size_t b = 0; b < b_size; b++) {
+			const double *BD = tiles->bd + b * d_size;
+			const float *fBD = ft->bd + b * d_size;
+			const double AB = tiles->ab[a * b_size + b];
+			const __m256 vAB = _mm256_set1_ps(ft->ab[a * b_size + b]);
+
+			for (size_t c = 0; c < c_size; c++) {
+				const double *CD = tiles->cd + c * d_size;
+				const float *fCD = ft->cd + c * d_size;
+				const double AC = tiles->ac[a * c_size + c];
+				const double BC = tiles->bc[b * c_size + c];
+				const __m256 vAC = _mm256_set1_ps(ft->ac[a * c_size + c]);
+				const __m256 vBC = _mm256_set1_ps(ft->bc[b * c_size + c]);
+
+				size_t local = 0;
+				size_t d = 0;
+				for (; d < d_vec; d += 8) {
+					__m256 D_abcd = _mm256_add_ps(vAB, _mm256_loadu_ps(fCD + d));
+					__m256 lhs1 = _mm256_add_ps(vAC, _mm256_loadu_ps(fBD + d));
+					__m256 lhs2 = _mm256_add_ps(_mm256_loadu_ps(fAD + d), vBC);
+					__m256 diff = _mm256_sub_ps(D_abcd, _mm256_min_ps(lhs1, lhs2));
+
+					int sure = _mm256_movemask_ps(
+					    _mm256_cmp_ps(diff, bound, _CMP_GT_OQ));
+					int maybe = _mm256_movemask_ps(
+					    _mm256_cmp_ps(diff, neg_bound, _CMP_GE_OQ));
+					local += __builtin_popcount(sure);
+
+					maybe &= ~sure;
+					if (!maybe) continue;
+
+					int fails = 0;
+					for (int half = 0; half < 2; half++) {
+						size_t e = d + 4 * half;
+						__m256d D_exact = _mm256_add_pd(_mm256_set1_pd(AB),
+						                                _mm256_loadu_pd(CD + e));
+						__m256d lhs1 = _mm256_add_pd(_mm256_set1_pd(AC),
+						                             _mm256_loadu_pd(BD + e));
+						__m256d lhs2 = _mm256_add_pd(_mm256_loadu_pd(AD + e),
+						                             _mm256_set1_pd(BC));
+						fails |= _mm256_movemask_pd(_mm256_or_pd(
+						             _mm256_cmp_pd(lhs1, D_exact, _CMP_LT_OQ),
+						             _mm256_cmp_pd(lhs2, D_exact, _CMP_LT_OQ)))
+						         << (4 * half);
+					}
+					local += __builtin_popcount(maybe & fails);
+				}
+
+				for (; d < d_size; d++) {
+					double D_abcd = AB + CD[d];
+					local += ((AC + BD[d]) < D_abcd) | ((AD[d] + BC) < D_abcd);
+				}
+				non_supporting_counter += local;
+			}
+		}
+	}
+
+	return non_supporting_counter;
+}
+
+/** @brief Like count_mixed_avx2(). With distances that often tie, as from
+ * matrices with few significant digits, many vectors have an uncertain taxon.
+ * So instead of branching on them, their indices are collected in `uncertain`
+ * and compared afterwards.
+ *
+ * @param uncertain - Space for `d_size + 16` indices.
+ */
+__attribute__((target("avx512f"))) static size_t
+count_mixed_avx512(const quartet_tiles *tiles, const single_tiles *ft,
+                   uint32_t *uncertain) {
+	const size_t a_size = tiles->a_size, b_size = tiles->b_size;
+	const size_t c_size = tiles->c_size, d_size = tiles->d_size;
+	const __mmask16 tail = (1u << (d_size % 16)) - 1;
+	const __m512 bound = _mm512_set1_ps(ft->bound);
+	const __m512 neg_bound = _mm512_set1_ps(-ft->bound);
+	const __m512i iota = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10,
+	                                       11, 12, 13, 14, 15);
+
+	size_t non_supporting_counter = 0;
+
+	for (size_t a = 0; a < a_size; a++) {
+		const double *AD = tiles->ad + a * d_size;
+		const float *fAD = ft->ad + a * d_size;
+
+		for (size_t b = 0; b < b_size; b++) {
+			const double *BD = tiles->bd + b * d_size;
+			const float *fBD = ft->bd + b * d_size;
+			const double AB = tiles->ab[a * b_size + b];
+			const __m512 fAB = _mm512_set1_ps(ft->ab[a * b_size + b]);
+
+			for (size_t c = 0; c < c_size; c++) {
+				const double *CD = tiles->cd + c * d_size;
+				const float *fCD = ft->cd + c * d_size;
+				const double AC = tiles->ac[a * c_size + c];
+				const double BC = tiles->bc[b * c_size + c];
+				const __m512 fAC = _mm512_set1_ps(ft->ac[a * c_size + c]);
+				const __m512 fBC = _mm512_set1_ps(ft->bc[b * c_size + c]);
+
+				size_t local = 0;
+				size_t count = 0;
+				for (size_t d = 0; d < d_size; d += 16) {
+					__mmask16 lanes = d + 16 <= d_size ? 0xffff : tail;
+
+					__m512 D_abcd =
+					    _mm512_add_ps(fAB, _mm512_maskz_loadu_ps(lanes, fCD + d));
+					__m512 lhs1 =
+					    _mm512_add_ps(fAC, _mm512_maskz_loadu_ps(lanes, fBD + d));
+					__m512 lhs2 =
+					    _mm512_add_ps(_mm512_maskz_loadu_ps(lanes, fAD + d), fBC);
+					__m512 diff = _mm512_sub_ps(D_abcd, _mm512_min_ps(lhs1, lhs2));
+
+					__mmask16 sure =
+					    _mm512_mask_cmp_ps_mask(lanes, diff, bound, _CMP_GT_OQ);
+					__mmask16 maybe = _mm512_mask_cmp_ps_mask(lanes, diff,
+					                                          neg_bound, _CMP_GE_OQ);
+					local += __builtin_popcount(sure);
+
+					maybe &= ~sure;
+					__m512i index =
+					    _mm512_add_epi32(_mm512_set1_epi32(d), iota);
+					_mm512_storeu_si512(uncertain + count,
+					                    _mm512_maskz_compress_epi32(maybe, index));
+					count += __builtin_popcount(maybe);
+				}
+
+				for (size_t i = 0; i < count; i++) {
+					size_t d = uncertain[i];
+					double D_abcd = AB + CD[d];
+					local += ((AC + BD[d]) < D_abcd) | ((AD[d] + BC) < D_abcd);
+				}
+
+				non_supporting_counter += local;
+			}
+		}
+	}
+
+	return non_supporting_counter;
+}
+
+#else
+
+size_t quartet_count_avx2(const quartet_tiles *tiles) {
+	return quartet_count_scalar(tiles);
+}
+
+size_t quartet_count_avx512(const quartet_tiles *tiles) {
+	return quartet_count_scalar(tiles);
+}
+
+#endif
+
+/** @brief Count the non-supporting quartets of a branch in single precision
+ * where the result is certain, and in double precision elsewhere. Without
+ * single precision copies of the tiles, see quartet_tiles_single(), or
+ * without AVX2, the widest double precision kernel is used.
+ *
+ * @param tiles - The distances of the branch.
+ * @returns the number of non-supporting quartets.
+ */
+size_t quartet_count_mixed(const quartet_tiles *tiles) {
+#ifdef HAVE_X86_DISPATCH
+	int avx512 = __builtin_cpu_supports("avx512f");
+	if ((avx512 || __builtin_cpu_supports("avx2")) && tiles->single.pool) {
+		size_t non_supporting_counter = 0;
+		uint32_t *uncertain =
+		    avx512 && tiles->d_size < INT32_MAX - 16
+		        ? scratch_get(tiles->scratch,
+		                      (tiles->d_size + 16) * sizeof(uint32_t))
+		        : NULL;
+		if (uncertain) {
+			non_supporting_counter =
+			    count_mixed_avx512(tiles, &tiles->single, uncertain);
+		} else {
+			non_supporting_counter = count_mixed_avx2(tiles, &tiles->single);
+		}
+		scratch_put(tiles->scratch, uncertain);
+		return non_supporting_counter;
+	}
+	if (avx512) return quartet_count_avx512(tiles);
+	if (__builtin_cpu_supports("avx2")) return quartet_count_avx2(tiles);
+#endif
+	return quartet_count_scalar(tiles);
+}
+
+/** @brief Add single precision copies to the tiles of a branch, for
+ * quartet_count_mixed(). They are made once per branch and shared by all its
+ * slices; see quartet_count_tasks().
+ *
+ * @param pool - The copies are stored in a buffer of this pool.
+ * @param tiles - The distances of the branch. Free with quartet_tiles_free().
+ * @returns 0 on success, or -1 if out of memory, the CPU lacks AVX2, or a
+ * distance is not finite or too large for single precision. Then the tiles
+ * are left unchanged.
+ */
+int quartet_tiles_single(scratch_pool *pool, quartet_tiles *tiles) {
+#ifdef HAVE_X86_DISPATCH
+	if (!__builtin_cpu_supports("avx2")) return -1;
+
+	const size_t a = tiles->a_size, b = tiles->b_size;
+	const size_t c = tiles->c_size, d = tiles->d_size;
+	const double *source[6] = {tiles->ab, tiles->cd, tiles->ac,
+	                           tiles->bd, tiles->ad, tiles->bc};
+	const size_t cells[6] = {a * b, c * d, a * c, b * d, a * d, b * c};
+
+	single_tiles ft = {};
+	float **dest[6] = {&ft.ab, &ft.cd, &ft.ac, &ft.bd, &ft.ad, &ft.bc};
+
+	ft.pool = scratch_get(pool, (cells[0] + cells[1] + cells[2] + cells[3] +
+	                             cells[4] + cells[5]) *
+	                                sizeof(float));
+	if (!ft.pool) return -1;
+
+	double magnitude = 0;
+	float *ptr = ft.pool;
+	for (int k = 0; k < 6; k++) {
+		*dest[k] = ptr;
+		for (size_t i = 0; i < cells[k]; i++) {
+			double value = fabs(source[k][i]);
+			if (!(value <= FLT_MAX / 8)) {
+				scratch_put(pool, ft.pool);
+				return -1;
+			}
+			if (value > magnitude) magnitude = value;
+			ptr[i] = source[k][i];
+		}
+		ptr += cells[k];
+	}
+
+	/* Each distance is rounded once to single precision, each of the two
+	 * sums and their difference once more. That is less than 12 roundings of
+	 * magnitude in total. The sums compared in double precision add a few
+	 * double roundings, and tiny values a few float subnormals. */
+	double bound = 8 * FLT_EPSILON * magnitude + FLT_MIN;
+	ft.bound = nextafterf(bound, INFINITY);
+
+	tiles->single = ft;
+	return 0;
+#else
+	(void)pool;
+	(void)tiles;
+	return -1;
+#endif
+}
+
+/** @brief Select the kernel used by quartet_count() for a context.
+ *
+ * @param ctx - The context.
+ * @param name - One of "scalar", "avx2", "avx512", "mixed", "sorted", or NULL
+ * for the widest kernel the executing CPU supports.
+ * @returns 0 on success, -1 if the kernel is unknown or not supported.
+ */
+int quartet_kernel(afra_ctx *ctx, const char *name) {
+	if (!name) {
+		ctx->kernel = NULL;
+		return 0;
+	}
+	if (strcmp(name, "scalar") == 0) {
+		ctx->kernel = quartet_count_scalar;
+		return 0;
+	}
+	if (strcmp(name, "mixed") == 0) {
+		ctx->kernel = quartet_count_mixed;
+		return 0;
+	}
+	if (strcmp(name, "sorted") == 0) {
+		ctx->kernel = quartet_count_sorted;
+		return 0;
+	}
+#ifdef HAVE_X86_DISPATCH
+	if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+		ctx->kernel = quartet_count_avx2;
+		return 0;
+	}
+	if (strcmp(name, "avx512") == 0 && __builtin_cpu_supports("avx512f")) {
+		ctx->kernel = quartet_count_avx512;
+		return 0;
+	}
+#endif
+	return -1;
+}
+
+/** @brief Whether quartet_count() uses the mixed precision kernel, which
+ * needs quartet_tiles_single(). */
+int quartet_kernel_mixed(const afra_ctx *ctx) {
+	return ctx->kernel == quartet_count_mixed;
+}
+
+/** @brief Whether quartet_count() uses the sorted kernel, which has to be
+ * split differently; see quartet_count_tasks(). */
+int quartet_kernel_sorted(const afra_ctx *ctx) {
+	return ctx->kernel == quartet_count_sorted;
+}
+
+/** @brief Count the quartets of a branch that do not support it, using the
+ * kernel selected for the context, or else the widest vector unit available
+ * on the executing CPU.
+ *
+ * @param ctx - The context.
+ * @param tiles - The distances of the branch.
+ * @returns the number of non-supporting quartets.
+ */
+size_t quartet_count(const afra_ctx *ctx, const quartet_tiles *tiles) {
+	if (ctx->kernel) {
+		return ctx->kernel(tiles);
+	}
+#ifdef HAVE_X86_DISPATCH
+	if (__builtin_cpu_supports("avx512f")) {
+		return quartet_count_avx512(tiles);
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		return quartet_count_avx2(tiles);
+	}
+#endif
+	return quartet_count_scalar(tiles);
+}
@@ -0,0 +1,439 @@
+/** @file Counting non-supporting quartets by sorting instead of scanning.
+ *
+ * Copyright (C) 2016  Fabian Klötzl
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <float.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "quartet.h"
+
+/* A quartet (a,b,c,d) does not support the branch ab|cd, if
+ *
+ *     AC + BD < AB + CD   or   AD + BC < AB + CD.
+ *
+ * Rearranged, the first condition reads BD - CD < AB - AC. The left side only
+ * depends on b, c and d, the right side on a, b and c. So for fixed b and c,
+ * the taxa of D that satisfy it for some a are a prefix of D sorted by
+ * BD - CD, found by binary search. Likewise, the second condition reads
+ * AD - CD < AB - BC and yields a prefix of D sorted by AD - CD for fixed a and
+ * c. A quartet fails if d is in either prefix, so only the intersection of
+ * the two prefixes remains to be counted; it is found by scanning the shorter
+ * of the prefixes or their complements.
+ *
+ * The differences are sorted with single precision and round differently
+ * from the sums the other kernels compare. Thus a prefix only includes the taxa for which the result
+ * is certain. The few taxa within an error bound of the threshold are decided
+ * by the original expressions, which keeps the counts identical to
+ * quartet_count_scalar(). */
+
+/** A tile seen from either side; element (i,j) is at `data[i * row + j * col]`.
+ */
+typedef struct tile_view {
+	const double *data;
+	size_t row, col;
+} tile_view;
+
+#define AT(VIEW, I, J) ((VIEW).data[(I) * (VIEW).row + (J) * (VIEW).col])
+
+/** @brief Get the distances between two color classes, given as 0 to 3 for A
+ * to D. */
+static tile_view tile_between(const quartet_tiles *tiles, int i, int j) {
+	const size_t size[4] = {tiles->a_size, tiles->b_size, tiles->c_size,
+	                        tiles->d_size};
+	const double *const stored[4][4] = {
+	    {NULL, tiles->ab, tiles->ac, tiles->ad},
+	    {NULL, NULL, tiles->bc, tiles->bd},
+	    {NULL, NULL, NULL, tiles->cd},
+	    {NULL, NULL, NULL, NULL}};
+
+	if (i < j) return (tile_view){stored[i][j], size[j], 1};
+	return (tile_view){stored[j][i], 1, size[i]};
+}
+
+/** @brief Copy a tile row by row, so that the rows of D are contiguous. */
+static void tile_rows(double *dest, tile_view view, size_t rows,
+                      size_t cols) {
+	for (size_t i = 0; i < rows; i++) {
+		for (size_t j = 0; j < cols; j++) {
+			dest[i * cols + j] = AT(view, i, j);
+		}
+	}
+}
+
+/** A taxon of D with its key, as bits that sort like the key. */
+typedef struct keyed {
+	uint32_t bits;
+	uint32_t index;
+} keyed;
+
+static uint32_t key_bits(float key) {
+	uint32_t bits;
+	memcpy(&bits, &key, sizeof(bits));
+	return bits >> 31 ? ~bits : bits | (uint32_t)1 << 31;
+}
+
+static float bits_key(uint32_t bits) {
+	bits = bits >> 31 ? bits & ~((uint32_t)1 << 31) : ~bits;
+	float key;
+	memcpy(&key, &bits, sizeof(key));
+	return key;
+}
+
+/** @brief Sort by key with a radix sort over bytes. This is called for
+ * millions of short rows, where comparison sorts spend most of their time on
+ * mispredicted branches. Bytes that are the same for all keys, often the
+ * sign and exponent, are skipped.
+ *
+ * @param base - The rows to sort.
+ * @param temp - Space for as many rows.
+ * @param size - The number of rows.
+ */
+static void sort_keyed(keyed *base, keyed *temp, size_t size) {
+	uint32_t count[4][256];
+	memset(count, 0, sizeof(count));
+
+	for (size_t i = 0; i < size; i++) {
+		for (int k = 0; k < 4; k++) {
+			count[k][(base[i].bits >> (8 * k)) & 255]++;
+		}
+	}
+
+	keyed *from = base, *to = temp;
+	for (int k = 0; k < 4; k++) {
+		if (count[k][(from[0].bits >> (8 * k)) & 255] == size) continue;
+
+		uint32_t offset[256], sum = 0;
+		for (int digit = 0; digit < 256; digit++) {
+			offset[digit] = sum;
+			sum += count[k][digit];
+		}
+
+		for (size_t i = 0; i < size; i++) {
+			to[offset[(from[i].bits >> (8 * k)) & 255]++] = from[i];
+		}
+
+		keyed *swap = from;
+		from = to;
+		to = swap;
+	}
+
+	if (from != base) memcpy(base, from, size * sizeof(keyed));
+}
+
+/** The taxa of D sorted by one of the differences. */
+typedef struct sorted_row {
+	float *key;
+	uint32_t *order, *rank;
+} sorted_row;
+
+/** @brief Sort the taxa of D by `XD[d] - CD[d]`. */
+static void sort_row(sorted_row *row, keyed *temp, const double *XD,
+                     const double *CD, size_t d_size) {
+	for (size_t d = 0; d < d_size; d++) {
+		temp[d] = (keyed){key_bits(XD[d] - CD[d]), d};
+	}
+
+	sort_keyed(temp, temp + d_size, d_size);
+
+	for (size_t i = 0; i < d_size; i++) {
+		row->key[i] = bits_key(temp[i].bits);
+		row->order[i] = temp[i].index;
+		row->rank[temp[i].index] = i;
+	}
+}
+
+/** @brief The number of keys less than `bound`. The search does not branch
+ * on the keys, as the outcome of each step is unpredictable. */
+static size_t lower_bound(const float *key, size_t size, double bound) {
+	const float *base = key;
+	while (size > 1) {
+		size_t half = size / 2;
+		base = base[half - 1] < bound ? base + half : base;
+		size -= half;
+	}
+	return (base - key) + (size == 1 && *base < bound);
+}
+
+/** @brief The end of the keys less than `bound`, starting at `begin`. Used
+ * for the few keys near a threshold. */
+static size_t scan_bound(const float *key, size_t begin, size_t size,
+                         double bound) {
+	while (begin < size && key[begin] < bound) {
+		begin++;
+	}
+	return begin;
+}
+
+/** @brief Count the taxa at positions [begin, end) of `order` whose rank in
+ * another order is below `bound`. */
+static size_t count_below(const uint32_t *order, const uint32_t *rank,
+                          size_t begin, size_t end, size_t bound) {
+	size_t count = 0;
+	for (size_t i = begin; i < end; i++) {
+		count += rank[order[i]] < bound;
+	}
+	return count;
+}
+
+/** @brief The number of taxa among both the first `k1` of `first` and the
+ * first `k2` of `second`. */
+static size_t intersection(const sorted_row *first, size_t k1,
+                           const sorted_row *second, size_t k2,
+                           size_t d_size) {
+	size_t cost = k1 < k2 ? k1 : k2;
+	if (d_size - k1 < cost) cost = d_size - k1;
+	if (d_size - k2 < cost) cost = d_size - k2;
+
+	if (cost == k1) return count_below(first->order, second->rank, 0, k1, k2);
+	if (cost == k2) return count_below(second->order, first->rank, 0, k2, k1);
+	if (cost == d_size - k1) {
+		return k2 - count_below(first->order, second->rank, k1, d_size, k2);
+	}
+	return k1 - count_below(second->order, first->rank, k2, d_size, k1);
+}
+
+/** @brief The largest magnitude among the distances of a branch, or infinity
+ * if one of them is not finite. */
+static double tiles_magnitude(const quartet_tiles *tiles) {
+	const double *tile[6] = {tiles->ab, tiles->cd, tiles->ac,
+	                         tiles->bd, tiles->ad, tiles->bc};
+	const size_t cells[6] = {
+	    tiles->a_size * tiles->b_size, tiles->c_size * tiles->d_size,
+	    tiles->a_size * tiles->c_size, tiles->b_size * tiles->d_size,
+	    tiles->a_size * tiles->d_size, tiles->b_size * tiles->c_size};
+
+	double max = 0;
+	for (int k = 0; k < 6; k++) {
+		for (size_t i = 0; i < cells[k]; i++) {
+			double value = fabs(tile[k][i]);
+			if (!(value <= DBL_MAX)) return INFINITY;
+			if (value > max) max = value;
+		}
+	}
+	return max;
+}
+
+/** @brief Choose which color class plays the role of D. Swapping A and B, C
+ * and D, or both pairs keeps the branch ab|cd, so any class can. Sorting
+ * costs (a+b)·c·d·log d and the searches a·b·c·log d.
+ *
+ * @returns the order of the classes A to D in their new roles.
+ */
+static const int *choose_roles(const size_t size[4]) {
+	static const int roles[4][4] = {
+	    {2, 3, 1, 0}, {2, 3, 0, 1}, {0, 1, 3, 2}, {0, 1, 2, 3}};
+
+	const int *best = roles[3];
+	double best_cost = INFINITY;
+	for (int k = 0; k < 4; k++) {
+		const int *role = roles[k];
+		double a = size[role[0]], b = size[role[1]];
+		double c = size[role[2]], d = size[role[3]];
+		double cost = ((a + b) * c * d + 2 * a * b * c) * log2(d + 1);
+		if (cost < best_cost) {
+			best = role;
+			best_cost = cost;
+		}
+	}
+	return best;
+}
+
+/** @brief Count a slice of the rows of A with the scalar kernel. */
+static size_t scalar_slice(const quartet_tiles *tiles, size_t slice,
+                           size_t slices) {
+	size_t begin = slice * tiles->a_size / slices;
+	size_t end = (slice + 1) * tiles->a_size / slices;
+
+	quartet_tiles part = *tiles;
+	part.a_size = end - begin;
+	part.ab += begin * tiles->b_size;
+	part.ac += begin * tiles->c_size;
+	part.ad += begin * tiles->d_size;
+	return quartet_count_scalar(&part);
+}
+
+/** @brief The number of slices to split the sorted count of a branch into,
+ * such that each takes about `work` steps. The taxa of the class in the role
+ * of C are split, as every one of them is sorted for on its own. Slicing any
+ * other class would shrink it to the new D and cost O(n⁴) again.
+ *
+ * @param tiles - The distances of the branch.
+ * @param work - The steps per slice.
+ * @returns the number of slices, at least one.
+ */
+size_t quartet_sorted_slices(const quartet_tiles *tiles, size_t work) {
+	const size_t size[4] = {tiles->a_size, tiles->b_size, tiles->c_size,
+	                        tiles->d_size};
+	const int *role = choose_roles(size);
+
+	double a = size[role[0]], b = size[role[1]];
+	double c = size[role[2]], d = size[role[3]];
+	double steps = ((a + b) * c * d + 2 * a * b * c) * log2(d + 1);
+
+	double slices = ceil(steps / work);
+	if (slices > c) slices = c;
+	return slices > 1 ? slices : 1;
+}
+
+/** @brief Count the quartets of a branch that do not support it in
+ * O(n³ log n) time for sorting, plus the time to intersect the prefixes. The
+ * latter is small if most quartets agree on whether they support the
+ * branch, which makes this faster than scanning for large branches.
+ *
+ * If memory runs out, or the distances are too large to bound the rounding
+ * error, the scalar kernel is used instead.
+ *
+ * @param tiles - The distances of the branch.
+ * @returns the number of non-supporting quartets.
+ */
+size_t quartet_count_sorted(const quartet_tiles *tiles) {
+	return quartet_count_sorted_slice(tiles, 0, 1);
+}
+
+/** @brief Count one slice of the quartets of a branch with the sorted kernel;
+ * see quartet_sorted_slices(). The counts of all slices add up to
+ * quartet_count_sorted().
+ *
+ * @param tiles - The distances of the branch.
+ * @param slice - The slice, from 0.
+ * @param slices - The number of slices.
+ * @returns the number of non-supporting quartets in the slice.
+ */
+size_t quartet_count_sorted_slice(const quartet_tiles *tiles, size_t slice,
+                                  size_t slices) {
+	const size_t size[4] = {tiles->a_size, tiles->b_size, tiles->c_size,
+	                        tiles->d_size};
+	const int *role = choose_roles(size);
+
+	const size_t a_size = size[role[0]], b_size = size[role[1]];
+	const size_t c_size = size[role[2]], d_size = size[role[3]];
+	if (!a_size || !b_size || !c_size || !d_size) return 0;
+
+	const size_t c_begin = slice * c_size / slices;
+	const size_t c_end = (slice + 1) * c_size / slices;
+
+	// Beyond this, the differences may overflow as floats.
+	double magnitude = tiles_magnitude(tiles);
+	if (!(magnitude <= FLT_MAX / 8) || d_size > UINT32_MAX) {
+		return scalar_slice(tiles, slice, slices);
+	}
+
+	/* A key is off by at most one float rounding of a difference within
+	 * 2·magnitude, plus double roundings. The threshold and the sums compared
+	 * by the other kernels add a few more double roundings. */
+	const double margin = 4 * FLT_EPSILON * magnitude + FLT_MIN;
+
+	const tile_view AB = tile_between(tiles, role[0], role[1]);
+	const tile_view AC = tile_between(tiles, role[0], role[2]);
+	const tile_view BC = tile_between(tiles, role[1], role[2]);
+
+	size_t rows = a_size + b_size;
+	size_t c_count = c_end - c_begin;
+
+	// one buffer of the scratch pool, in the order of decreasing alignment
+	size_t xd_bytes = (rows + c_count) * d_size * sizeof(double);
+	size_t temp_bytes = 2 * d_size * sizeof(keyed);
+	size_t sorted_bytes = rows * sizeof(sorted_row);
+	size_t keys_bytes = rows * d_size * sizeof(float);
+	size_t ranks_bytes = 2 * rows * d_size * sizeof(uint32_t);
+
+	size_t bytes =
+	    xd_bytes + temp_bytes + sorted_bytes + keys_bytes + ranks_bytes;
+
+	char *buffer = scratch_get(tiles->scratch, bytes);
+	if (!buffer) return scalar_slice(tiles, slice, slices);
+
+	double *xd = (double *)buffer;
+	keyed *temp = (keyed *)(buffer + xd_bytes);
+	sorted_row *sorted = (sorted_row *)(buffer + xd_bytes + temp_bytes);
+	float *keys = (float *)((char *)sorted + sorted_bytes);
+	uint32_t *ranks = (uint32_t *)((char *)keys + keys_bytes);
+
+	double *AD = xd, *BD = xd + a_size * d_size, *CD = xd + rows * d_size;
+	tile_rows(AD, tile_between(tiles, role[0], role[3]), a_size, d_size);
+	tile_rows(BD, tile_between(tiles, role[1], role[3]), b_size, d_size);
+	tile_view CD_slice = tile_between(tiles, role[2], role[3]);
+	CD_slice.data += c_begin * CD_slice.row;
+	tile_rows(CD, CD_slice, c_count, d_size);
+
+	for (size_t i = 0; i < rows; i++) {
+		sorted[i] = (sorted_row){keys + i * d_size, ranks + 2 * i * d_size,
+		                         ranks + (2 * i + 1) * d_size};
+	}
+	sorted_row *by_a = sorted, *by_b = sorted + a_size;
+
+	size_t non_supporting_counter = 0;
+
+	for (size_t c = c_begin; c < c_end; c++) {
+		const double *CD_c = CD + (c - c_begin) * d_size;
+		for (size_t a = 0; a < a_size; a++) {
+			sort_row(&by_a[a], temp, AD + a * d_size, CD_c, d_size);
+		}
+		for (size_t b = 0; b < b_size; b++) {
+			sort_row(&by_b[b], temp, BD + b * d_size, CD_c, d_size);
+		}
+
+		for (size_t a = 0; a < a_size; a++) {
+			const sorted_row *second = &by_a[a];
+			const double *AD_a = AD + a * d_size;
+			const double AC_ = AT(AC, a, c);
+
+			for (size_t b = 0; b < b_size; b++) {
+				const sorted_row *first = &by_b[b];
+				const double *BD_b = BD + b * d_size;
+				const double AB_ = AT(AB, a, b);
+				const double BC_ = AT(BC, b, c);
+
+				// BD - CD < AB - AC
+				double s = AB_ - AC_;
+				size_t low1 = lower_bound(first->key, d_size, s - margin);
+				size_t high1 = scan_bound(first->key, low1, d_size, s + margin);
+
+				// AD - CD < AB - BC
+				double t = AB_ - BC_;
+				size_t low2 = lower_bound(second->key, d_size, t - margin);
+				size_t high2 = scan_bound(second->key, low2, d_size, t + margin);
+
+				size_t local =
+				    low1 + low2 - intersection(first, low1, second, low2, d_size);
+
+#define FAILS(D)                                                               \
+	((AC_ + BD_b[D]) < (AB_ + CD_c[D]) || (AD_a[D] + BC_) < (AB_ + CD_c[D]))
+
+				// decide the uncertain taxa not already counted
+				for (size_t i = low1; i < high1; i++) {
+					size_t d = first->order[i];
+					if (second->rank[d] >= low2) local += FAILS(d);
+				}
+				for (size_t i = low2; i < high2; i++) {
+					size_t d = second->order[i];
+					if (first->rank[d] >= high1) local += FAILS(d);
+				}
+
+#undef FAILS
+
+				non_supporting_counter += local;
+			}
+		}
+	}
+
+	scratch_put(tiles->scratch, buffer);
+	return non_supporting_counter;
+}
@@ -0,0 +1,134 @@
+/*
+ * Copyright (C) 2015 - 2016  Fabian Klötzl
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+
+#include "scratch.h"
+
+/** @brief Take a buffer from the pool.
+ *
+ * The smallest unused buffer holding at least `bytes` is chosen. Otherwise
+ * the largest unused one is grown, so that big buffers are not wasted on
+ * small requests.
+ *
+ * @param pool - The pool.
+ * @param bytes - The required size.
+ * @returns the buffer, or NULL if out of memory. Return it with
+ * scratch_put().
+ */
+void *scratch_get(scratch_pool *pool, size_t bytes) {
+	void *data = NULL;
+
+#pragma omp critical(afra_scratch)
+	{
+		scratch_buffer *best = NULL, *largest = NULL;
+		for (size_t i = 0; i < pool->count; i++) {
+			scratch_buffer *buffer = &pool->buffers[i];
+			if (buffer->used) continue;
+
+			if (buffer->capacity >= bytes &&
+			    (!best || buffer->capacity < best->capacity)) {
+				best = buffer;
+			}
+			if (!largest || buffer->capacity > largest->capacity) {
+				largest = buffer;
+			}
+		}
+
+		if (!best && !largest) {
+			scratch_buffer *buffers = realloc(
+			    pool->buffers, (pool->count + 1) * sizeof(scratch_buffer));
+			if (buffers) {
+				pool->buffers = buffers;
+				largest = &buffers[pool->count++];
+				*largest = (scratch_buffer){};
+			}
+		}
+
+		if (!best && largest) {
+			// free instead of realloc, as the old content is not needed
+			free(largest->data);
+			largest->capacity = 0;
+			largest->data = malloc(bytes ? bytes : 1);
+			if (largest->data) {
+				largest->capacity = bytes;
+				best = largest;
+			}
+		}
+
+		if (best) {
+			best->used = 1;
+			data = best->data;
+		}
+	}
+
+	return data;
+}
+
+static scratch_buffer *find(scratch_pool *pool, const void *data) {
+	for (size_t i = 0; i < pool->count; i++) {
+		if (pool->buffers[i].data == data) return &pool->buffers[i];
+	}
+	return NULL;
+}
+
+/** @brief Grow a buffer taken from the pool, keeping its content.
+ *
+ * @param pool - The pool.
+ * @param data - The buffer.
+ * @param bytes - The new size.
+ * @returns the buffer, which may have moved, or NULL if out of memory. In
+ * the latter case the old buffer is still valid.
+ */
+void *scratch_resize(scratch_pool *pool, void *data, size_t bytes) {
+	void *resized = NULL;
+
+#pragma omp critical(afra_scratch)
+	{
+		scratch_buffer *buffer = find(pool, data);
+		if (buffer && buffer->capacity >= bytes) {
+			resized = data;
+		} else if (buffer) {
+			resized = realloc(data, bytes);
+			if (resized) {
+				buffer->data = resized;
+				buffer->capacity = bytes;
+			}
+		}
+	}
+
+	return resized;
+}
+
+/** @brief Return a buffer to the pool. */
+void scratch_put(scratch_pool *pool, void *data) {
+	if (!data) return;
+
+#pragma omp critical(afra_scratch)
+	{
+		scratch_buffer *buffer = find(pool, data);
+		if (buffer) buffer->used = 0;
+	}
+}
+
+/** @brief Free all buffers of the pool. */
+void scratch_free(scratch_pool *pool) {
+	for (size_t i = 0; i < pool->count; i++) {
+		free(pool->buffers[i].data);
+	}
+	free(pool->buffers);
+	*pool = (scratch_pool){};
+}
@@ -0,0 +1,40 @@
+/*
+ * Copyright (C) 2015 - 2016  Fabian Klötzl
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+typedef struct scratch_buffer {
+	void *data;
+	size_t capacity;
+	int used;
+} scratch_buffer;
+
+/** Scratch buffers for large temporary arrays, such as the tiles of a branch
+ * or the working copy of neighbor joining. A buffer returned to the pool is
+ * handed out again, so the memory is reused across branches and matrices
+ * instead of being allocated anew. The pool grows to one buffer per
+ * concurrent user and keeps them until scratch_free(). Thread-safe. */
+typedef struct scratch_pool {
+	scratch_buffer *buffers;
+	size_t count;
+} scratch_pool;
+
+void *scratch_get(scratch_pool *, size_t bytes);
+void *scratch_resize(scratch_pool *, void *data, size_t bytes);
+void scratch_put(scratch_pool *, void *data);
+void scratch_free(scratch_pool *);
@@ -0,0 +1,232 @@
+/*
+ * Copyright (C) 2015 - 2016  Fabian Klötzl
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <ctype.h>
+#include <err.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "batch.h"
+#include "global.h"
+#include "io.h"
+#include "matrix.h"
+#include "serve.h"
+#include "stats.h"
+
+/* In server mode afra stays alive and analyses a stream of concatenated
+ * matrices, writing one result per matrix as soon as it is done. The process,
+ * and with it the OpenMP thread pool, is kept across requests, so small
+ * matrices do not pay for start up. Matrices are read from stdin or from the
+ * connections to a UNIX domain socket, one connection at a time. A matrix
+ * that cannot be analysed yields a line `error: MESSAGE` instead of a result;
+ * after a malformed matrix the rest of the stream is dropped. A client that
+ * sends or reads nothing for SERVE_TIMEOUT seconds is dropped, so it cannot
+ * hold up the others. */
+
+/** Seconds a connection may stay idle. */
+#define SERVE_TIMEOUT 10
+
+static volatile sig_atomic_t stopping = 0;
+
+static void stop_signal(int signum) {
+	(void)signum;
+	stopping = 1;
+}
+
+/** @brief Skip white space between matrices.
+ *
+ * @returns 1 if another matrix follows, or 0 at the end of the stream.
+ */
+static int next_matrix(FILE *in) {
+	int c;
+	do {
+		c = getc(in);
+	} while (c != EOF && isspace(c));
+
+	if (c == EOF) return 0;
+	ungetc(c, in);
+	return 1;
+}
+
+/** @brief Record why reading a stream failed, unless it was malformed. */
+static int read_failed(afra_ctx *ctx, FILE *in) {
+	if (!ferror(in)) return -1;
+
+	if (errno == EAGAIN || errno == EWOULDBLOCK) {
+		afra_clear(ctx);
+		return afra_fail(ctx, AFRA_ERROR_IO,
+		                 "timed out after %d seconds without input",
+		                 SERVE_TIMEOUT);
+	}
+	return afra_fail(ctx, AFRA_ERROR_IO, "read error: %s", strerror(errno));
+}
+
+/** @brief Analyse all matrices of a stream.
+ *
+ * @param ctx - The context.
+ * @param in - The stream of matrices.
+ * @param out - Where the results go; flushed after each matrix.
+ * @param fn - The analysis.
+ * @param data - Passed on to `fn`.
+ * @param index - The number of matrices analysed so far; incremented.
+ * @returns 0 at the end of the stream, or -1 if it had to be dropped.
+ */
+static int serve_stream(afra_ctx *ctx, FILE *in, FILE *out, batch_fn fn,
+                        void *data, size_t *index) {
+	while (!stopping && next_matrix(in)) {
+		afra_clear(ctx);
+
+		matrix distance;
+		stats_timer timer = stats_start(ctx->stats);
+		if (read_matrix(ctx, in, ctx->flags, &distance) != 0) {
+			read_failed(ctx, in);
+			if (stopping) return -1;
+			fprintf(out, "error: %s\n", afra_message(ctx));
+			fflush(out);
+			return -1;
+		}
+		stats_stop(ctx->stats, STATS_PARSE, timer);
+
+		// a matrix that cannot be analysed only fails its own request
+		if (distance.size < 4) {
+			fprintf(out, "error: this program requires at least four taxa.\n");
+		} else if (fn((*index)++, &distance, out, data) != 0 && !ferror(out)) {
+			fprintf(out, "error: %s\n", afra_message(ctx));
+		}
+		matrix_free(&distance);
+
+		if (fflush(out) != 0 || ferror(out)) return -1;
+	}
+
+	if (ferror(in) && !stopping) {
+		read_failed(ctx, in);
+		fprintf(out, "error: %s\n", afra_message(ctx));
+		fflush(out);
+		return -1;
+	}
+
+	return 0;
+}
+
+/** @brief Create a UNIX domain socket listening at `path`. A stale socket
+ * left over at that path is replaced.
+ */
+static int serve_listen(const char *path) {
+	struct sockaddr_un address = {.sun_family = AF_UNIX};
+	if (strlen(path) >= sizeof(address.sun_path)) {
+		errx(1, "%s: socket path too long.", path);
+	}
+	strcpy(address.sun_path, path);
+
+	struct stat st;
+	if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+		unlink(path);
+	}
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) err(1, "socket");
+
+	if (bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+	    listen(fd, 16) != 0) {
+		err(1, "%s", path);
+	}
+
+	return fd;
+}
+
+/** @brief Serve one connection until the client closes it or times out. */
+static void serve_connection(afra_ctx *ctx, int fd, batch_fn fn, void *data,
+                             size_t *index) {
+	struct timeval timeout = {.tv_sec = SERVE_TIMEOUT};
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+	int out_fd = dup(fd);
+	FILE *in = fdopen(fd, "r");
+	FILE *out = out_fd < 0 ? NULL : fdopen(out_fd, "w");
+
+	if (!in || !out) {
+		warn("connection");
+		if (in) fclose(in);
+		else close(fd);
+		if (out) fclose(out);
+		else if (out_fd >= 0) close(out_fd);
+		return;
+	}
+
+	if (serve_stream(ctx, in, out, fn, data, index) != 0 && !stopping) {
+		warnx("dropped a connection: %s",
+		      ferror(out) ? strerror(errno) : afra_message(ctx));
+	}
+
+	fclose(in);
+	fclose(out);
+}
+
+/** @brief Analyse matrices as they arrive, until the end of the input.
+ *
+ * @param ctx - The context.
+ * @param socket_path - The path of a UNIX domain socket to listen at. If
+ * NULL, matrices are read from stdin and the results written to stdout.
+ * Otherwise, afra serves until it receives SIGINT or SIGTERM.
+ * @param fn - The analysis.
+ * @param data - Passed on to `fn`.
+ */
+void serve(afra_ctx *ctx, const char *socket_path, batch_fn fn, void *data) {
+	size_t index = 0;
+
+	if (!socket_path) {
+		if (serve_stream(ctx, stdin, stdout, fn, data, &index) != 0) {
+			if (ferror(stdout)) err(1, "stdout");
+			errx(1, "%s", afra_message(ctx));
+		}
+		return;
+	}
+
+	// Clients that go away must not take the server down with them.
+	signal(SIGPIPE, SIG_IGN);
+
+	// Interrupt accept() on shutdown, so the socket gets removed.
+	struct sigaction action = {.sa_handler = stop_signal};
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+
+	int listener = serve_listen(socket_path);
+
+	while (!stopping) {
+		int fd = accept(listener, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			warn("accept");
+			break;
+		}
+
+		serve_connection(ctx, fd, fn, data, &index);
+	}
+
+	close(listener);
+	unlink(socket_path);
+}
@@ -0,0 +1,210 @@
+/*
+ * Copyright (C) 2015 - 2016  Fabian Klötzl
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "stats.h"
+
+static const char *phase_names[STATS_PHASES] = {"parse", "nj", "support",
+                                                "output"};
+
+double stats_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static double cpu_now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/** @brief Start collecting statistics.
+ *
+ * @param st - The statistics; the context should point to them afterwards.
+ * @param threads - The number of threads doing the work.
+ * @returns 0 on success, or -1 if out of memory.
+ */
+int stats_init(stats *st, size_t threads) {
+	*st = (stats){.start = stats_now(), .slots = threads};
+	st->busy = calloc(threads, sizeof(double));
+	return st->busy ? 0 : -1;
+}
+
+void stats_free(stats *st) {
+	free(st->busy);
+	*st = (stats){};
+}
+
+/** @brief Start timing a phase. Cheap if no statistics are collected. */
+stats_timer stats_start(const stats *st) {
+	if (!st) return (stats_timer){};
+	return (stats_timer){.wall = stats_now(), .cpu = cpu_now()};
+}
+
+/** @brief Add the time since `timer` was started to a phase. The CPU time is
+ * that of the whole process, so phases running at the same time for
+ * different matrices are each charged all of it. */
+void stats_stop(stats *st, enum stats_phase phase, stats_timer timer) {
+	if (!st) return;
+	double wall = stats_now() - timer.wall, cpu = cpu_now() - timer.cpu;
+
+#pragma omp atomic
+	st->wall[phase] += wall;
+#pragma omp atomic
+	st->cpu[phase] += cpu;
+
+	if (phase == STATS_PARSE) {
+#pragma omp atomic
+		st->matrices++;
+	}
+}
+
+/** @brief The slot for the busy time of the calling thread: its number in
+ * the outermost parallel region, i.e. the team of quartet_all() or of a
+ * batch. Outside of parallel regions, it is the first slot. */
+static size_t busy_slot(void) {
+#ifdef _OPENMP
+	int number = omp_get_ancestor_thread_num(1);
+	return number > 0 ? (size_t)number : 0;
+#else
+	return 0;
+#endif
+}
+
+/** @brief Add to the busy time of the calling thread. */
+void stats_busy(stats *st, double seconds) {
+	if (!st) return;
+
+	// more threads than expected share the last slot
+	size_t slot = busy_slot();
+	if (slot >= st->slots) slot = st->slots - 1;
+
+#pragma omp atomic
+	st->busy[slot] += seconds;
+}
+
+/** @brief Record the time and size of a branch, once its support value is
+ * known.
+ *
+ * @param seconds - The wall time from start to end of the branch.
+ * @param a - The size of A; b, c and d likewise.
+ * @param quartets - The number of quartets evaluated.
+ */
+void stats_branch_done(stats *st, double seconds, size_t a, size_t b,
+                       size_t c, size_t d, size_t quartets) {
+	if (!st) return;
+
+#pragma omp atomic
+	st->quartets += quartets;
+
+#pragma omp critical(stats_top)
+	{
+		size_t i = st->top_count;
+		if (i < STATS_TOP) st->top_count++;
+
+		// insertion into the list sorted by decreasing time
+		while (i > 0 && st->top[i - 1].seconds < seconds) {
+			if (i < STATS_TOP) st->top[i] = st->top[i - 1];
+			i--;
+		}
+		if (i < STATS_TOP) {
+			st->top[i] = (stats_branch){seconds, a, b, c, d};
+		}
+	}
+}
+
+static long peak_rss(void) {
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0) return -1;
+	return usage.ru_maxrss;
+}
+
+/** @brief Print the statistics in a human readable form. */
+void stats_print(FILE *out, const stats *st) {
+	double wall = stats_now() - st->start;
+	double support = st->wall[STATS_SUPPORT];
+
+	fprintf(out, "afra statistics\n");
+	fprintf(out, "  matrices       %zu\n", st->matrices);
+	fprintf(out, "  wall time      %.3f s\n", wall);
+	fprintf(out, "  phase          wall [s]     cpu [s]\n");
+	for (int p = 0; p < STATS_PHASES; p++) {
+		fprintf(out, "  %-10s %12.3f %11.3f\n", phase_names[p], st->wall[p],
+		        st->cpu[p]);
+	}
+	fprintf(out, "  quartets       %zu (%.3g per second)\n", st->quartets,
+	        support > 0 ? st->quartets / support : 0);
+	fprintf(out, "  peak RSS       %ld KiB\n", peak_rss());
+
+	fprintf(out, "  thread busy [s]");
+	for (size_t i = 0; i < st->slots; i++) {
+		fprintf(out, " %.3f", st->busy[i]);
+	}
+	fprintf(out, "\n");
+
+	fprintf(out, "  top branches   seconds      |A|      |B|      |C|      |D|\n");
+	for (size_t i = 0; i < st->top_count; i++) {
+		const stats_branch *br = &st->top[i];
+		fprintf(out, "  %-10zu %11.4f %8zu %8zu %8zu %8zu\n", i + 1,
+		        br->seconds, br->a, br->b, br->c, br->d);
+	}
+}
+
+/** @brief Print the statistics as a JSON object. */
+void stats_json(FILE *out, const stats *st) {
+	double wall = stats_now() - st->start;
+	double support = st->wall[STATS_SUPPORT];
+
+	fprintf(out, "{\n  \"matrices\": %zu,\n  \"wall\": %.6f,\n  \"phases\": {",
+	        st->matrices, wall);
+	for (int p = 0; p < STATS_PHASES; p++) {
+		fprintf(out, "%s\n    \"%s\": {\"wall\": %.6f, \"cpu\": %.6f}",
+		        p ? "," : "", phase_names[p], st->wall[p], st->cpu[p]);
+	}
+	fprintf(out, "\n  },\n");
+
+	fprintf(out, "  \"quartets\": %zu,\n", st->quartets);
+	fprintf(out, "  \"quartets_per_second\": %.6g,\n",
+	        support > 0 ? st->quartets / support : 0);
+	fprintf(out, "  \"peak_rss_kib\": %ld,\n", peak_rss());
+
+	fprintf(out, "  \"thread_busy\": [");
+	for (size_t i = 0; i < st->slots; i++) {
+		fprintf(out, "%s%.6f", i ? ", " : "", st->busy[i]);
+	}
+	fprintf(out, "],\n");
+
+	fprintf(out, "  \"top_branches\": [");
+	for (size_t i = 0; i < st->top_count; i++) {
+		const stats_branch *br = &st->top[i];
+		fprintf(out,
+		        "%s\n    {\"seconds\": %.6f, \"a\": %zu, \"b\": %zu, \"c\": "
+		        "%zu, \"d\": %zu}",
+		        i ? "," : "", br->seconds, br->a, br->b, br->c, br->d);
+	}
+	fprintf(out, "\n  ]\n}\n");
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2015 - 2016  Fabian Klötzl
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdio.h>
+
+/** The phases of an analysis, timed separately. */
+enum stats_phase {
+	STATS_PARSE,
+	STATS_NJ,
+	STATS_SUPPORT,
+	STATS_OUTPUT,
+	STATS_PHASES
+};
+
+/** The number of most expensive branches to report. */
+#define STATS_TOP 10
+
+typedef struct stats_branch {
+	double seconds;
+	size_t a, b, c, d;
+} stats_branch;
+
+/** Statistics of a run, collected when --stats is given. Phase times are
+ * summed over all matrices. */
+typedef struct stats {
+	double start;
+	size_t matrices;
+	double wall[STATS_PHASES], cpu[STATS_PHASES];
+	size_t quartets;
+	size_t slots;
+	double *busy;
+	size_t top_count;
+	stats_branch top[STATS_TOP];
+} stats;
+
+typedef struct stats_timer {
+	double wall, cpu;
+} stats_timer;
+
+int stats_init(stats *, size_t threads);
+void stats_free(stats *);
+
+/* The following functions do nothing if no statistics are collected, i.e. the
+ * stats are NULL. */
+
+stats_timer stats_start(const stats *);
+void stats_stop(stats *, enum stats_phase, stats_timer);
+double stats_now(void);
+
+void stats_busy(stats *, double seconds);
+void stats_branch_done(stats *, double seconds, size_t a, size_t b, size_t c,
+                       size_t d, size_t quartets);
+
+void stats_print(FILE *out, const stats *);
+void stats_json(FILE *out, const stats *);
@@ -0,0 +1,135 @@
+/*
+ * Copyright (C) 2015 - 2016  Fabian Klötzl
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Build a caterpillar tree of 100000 leaves, the deepest tree there is, and
+ * annotate and print it. Every tree walk used to recurse once per level and
+ * overflowed the stack on such trees; the stack is limited to 256 KiB, so
+ * this fails even with the small frames of an optimized build. The matrix of
+ * this many taxa does not fit into memory; it is mapped without backing, so
+ * all distances read as zero, and only a few quartets are sampled per
+ * branch. */
+
+#define _DEFAULT_SOURCE
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include "global.h"
+#include "graph.h"
+#include "matrix.h"
+#include "quartet.h"
+
+#define LEAVES 100000
+
+static afra_ctx *ctx;
+
+static void check(int status) {
+	if (status != 0) errx(1, "%s", afra_message(ctx));
+}
+
+/** @brief Join the leaves one after another: ((((0,1),2),3),...). */
+static void caterpillar(tree_s *tree) {
+	size_t size = tree->size;
+	tree_node *leaves = tree->pool, *inner = tree->pool + size;
+
+	for (size_t i = 0; i < size; i++) {
+		leaves[i] = LEAF(i);
+	}
+
+	inner[0] = BRANCH(.left_branch = &leaves[0], .right_branch = &leaves[1],
+	                  .left_dist = 1, .right_dist = 1, .index = -1);
+	for (size_t k = 1; k < size - 3; k++) {
+		inner[k] = BRANCH(.left_branch = &inner[k - 1],
+		                  .right_branch = &leaves[k + 1], .left_dist = 1,
+		                  .right_dist = 1, .index = -1);
+	}
+
+	tree->root.left_branch = &inner[size - 4];
+	tree->root.right_branch = &leaves[size - 2];
+	tree->root.extra_branch = &leaves[size - 1];
+	tree->root.left_dist = tree->root.right_dist = tree->root.extra_dist = 1;
+}
+
+int main(void) {
+	struct rlimit stack;
+	if (getrlimit(RLIMIT_STACK, &stack) == 0 && stack.rlim_max >= 256 << 10) {
+		stack.rlim_cur = 256 << 10;
+		setrlimit(RLIMIT_STACK, &stack);
+	}
+
+	ctx = afra_new(NULL);
+	if (!ctx) err(1, "Out of memory");
+	check(afra_set_samples(ctx, 4, 1));
+
+	int flags = MATRIX_PACKED | MATRIX_FLOAT;
+	size_t bytes = matrix_bytes(LEAVES, flags);
+	void *data = mmap(NULL, bytes, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS |
+	                                              MAP_NORESERVE,
+	                  -1, 0);
+	if (data == MAP_FAILED) err(1, "mmap");
+
+	char **names = malloc(LEAVES * sizeof(char *));
+	char *name_data = malloc(LEAVES * 8);
+	if (!names || !name_data) err(1, "Out of memory");
+	for (size_t i = 0; i < LEAVES; i++) {
+		names[i] = name_data + 8 * i;
+		sprintf(names[i], "T%zu", i);
+	}
+
+	matrix distance = {
+	    .size = LEAVES, .data = data, .names = names, .flags = flags};
+
+	tree_s tree;
+	if (tree_init(&tree, LEAVES) != 0) err(1, "Out of memory");
+	caterpillar(&tree);
+
+	check(quartet_all(ctx, &distance, &tree));
+
+	// with all distances equal, no quartet contradicts a branch
+	for (size_t i = 1; i < LEAVES - 3; i++) {
+		if (tree.pool[LEAVES + i].left_support != 1) {
+			errx(1, "wrong support at inner node %zu", i);
+		}
+	}
+	if (tree.root.left_support != 1) errx(1, "wrong support at the root");
+
+	buffer out = {};
+	if (newick_sv_buffer(ctx, &out, &tree.root, names) != 0) {
+		errx(1, "Out of memory");
+	}
+
+	size_t open = 0, close = 0, commas = 0;
+	for (size_t i = 0; i < out.length; i++) {
+		open += out.data[i] == '(';
+		close += out.data[i] == ')';
+		commas += out.data[i] == ',';
+	}
+	if (open != LEAVES - 2 || close != open || commas != LEAVES - 1) {
+		errx(1, "malformed tree: %zu (, %zu ), %zu commas", open, close,
+		     commas);
+	}
+
+	buffer_free(&out);
+	tree_free(&tree);
+	free(name_data);
+	free(names);
+	munmap(data, bytes);
+	afra_free(ctx);
+	return EXIT_SUCCESS;
+}